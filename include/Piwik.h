@@ -15,6 +15,10 @@
 
 #include "../src/Config.h"
 #include "../src/Utilities.h"
+#include "../src/Queue.h"
+#include "../src/Compressor.h"
+#include "../src/Journal.h"
+#include "../src/Transport.h"
 #include "../src/State.h"
 #include "../src/Dispatcher.h"
 #include "../src/Client.h"
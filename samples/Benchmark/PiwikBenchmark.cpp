@@ -0,0 +1,371 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         PiwikBenchmark.cpp
+// Description:  Console program measuring the throughput of the tracker against the loopback transport and a local server,
+//               and the hand-over of requests to the service against the mutex-guarded deque it replaced
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+// Build the library first (build/VS2010, Release), then PiwikBenchmark.sln in this folder, 
+// or from a Visual Studio command prompt in this folder:
+//   cl /EHsc /O2 /DUNICODE /D_UNICODE PiwikBenchmark.cpp /link /LIBPATH:..\..\build\VS2010\Release
+//      PiwikClient.lib winhttp.lib ws2_32.lib advapi32.lib user32.lib
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <winsock2.h>
+#include "../../include/Piwik.h"
+#include <stdio.h>
+
+#define BENCH_URL      L"http://localhost/piwik.php"
+#define BENCH_SITE     1
+#define BENCH_EVENTS   20000      // tracking calls per thread
+#define BENCH_REQUESTS 2000       // requests sent per lane setting
+#define BENCH_VISITORS 64         // users tracked in turn
+#define BENCH_LATENCY  20         // msec per exchange with the loopback server
+#define BENCH_PORT     18080      // port of the local HTTP server
+#define BENCH_LOCAL_URL L"http://127.0.0.1:18080/piwik.php"
+#define BENCH_QUERY    "?idsite=1&rec=1&apiv=1&r=482913&_id=3f2a9c01d4e7b865&url=http%3A%2F%2Flocalhost%2Fbenchmark" \
+                       "&e_c=Benchmark&e_a=Handover&e_n=Call&e_v=1&ua=Piwik%20Client%20Windows%20Desktop&lang=en-US&res=1920x1080"
+
+// A tracking thread: calls TrackEvent as fast as it can
+
+struct PiwikLoad
+{
+	PiwikClient* Client;
+	int Count;
+};
+
+static unsigned __stdcall TrackingThread (void* p)
+{
+	PiwikLoad* ld = (PiwikLoad*) p;
+
+	for (int i = 0; i < ld->Count; i++)
+		ld->Client->TrackEvent (L"/benchmark", L"Benchmark", L"Track", L"Call", (float) i);
+
+	return 0;
+}
+
+// A client sending to a loopback transport, queuing without ever dropping requests
+
+static PiwikClient* CreateClient (PiwikTransport* t)
+{
+	PiwikClient* pwk = new PiwikClient (BENCH_URL, BENCH_SITE);
+
+	pwk->SetTransport (t);
+	pwk->SetDispatchInterval (1);
+	pwk->SetQueueLimits (PIWIK_QUEUE_CAPACITY, PIWIK_QUEUE_SIZE, PIWIK_OVERFLOW_BLOCK, 60000);
+
+	return pwk;
+}
+
+// Tracking threads calling into the same client at once: the rate of tracking calls and how often
+// they had to wait for each other's locks
+
+static void RunTracking (int thr)
+{
+	PiwikLoopbackTransport lpb;
+	PiwikClient* pwk = CreateClient (&lpb);
+	std::vector<HANDLE> hnd;
+	PiwikLoad ld;
+	PiwikLockStatistics lck;
+	PiwikStatistics sts;
+	LONGLONG t0, t1;
+
+	ld.Client = pwk, ld.Count = BENCH_EVENTS;
+
+	t0 = ReadClock ();
+	for (int i = 0; i < thr; i++)
+		hnd.push_back ((HANDLE) _beginthreadex (0, 0, TrackingThread, &ld, 0, 0));
+	::WaitForMultipleObjects ((DWORD) hnd.size (), &hnd[0], TRUE, INFINITE);
+	t1 = ReadClock ();
+
+	for (int i = 0; i < thr; i++)
+		::CloseHandle (hnd[i]);
+
+	pwk->GetLockStatistics (lck);
+	pwk->Shutdown ();
+	sts = pwk->GetStatistics ();
+
+	printf ("%2d threads: %9.0f calls/s, %6.2f usec/call, %8lld contentions, %8lld usec waited, %lld of %lld sent\n", thr,
+			(double) thr * BENCH_EVENTS * 1000000 / ElapsedMicroseconds (t0, t1), (double) sts.TrackTime / max (sts.Tracked, (_int64) 1),
+			lck.Contentions, lck.WaitTime, sts.Acknowledged, sts.Tracked);
+
+	delete pwk;
+}
+
+// Requests of many visitors sent over a number of lanes to a loopback server answering after a fixed latency:
+// the time from the first tracking call until the shutdown has delivered everything
+
+static void RunSending (int lns)
+{
+	PiwikLoopbackTransport lpb (BENCH_LATENCY);
+	PiwikClient* pwk = CreateClient (&lpb);
+	PiwikLoopbackStatistics lps;
+	PiwikStatistics sts;
+	TCHAR usr[32];
+	LONGLONG t0, t1;
+
+	pwk->SetConcurrency (lns);
+	pwk->SetBatching (10);
+
+	t0 = ReadClock ();
+	for (int i = 0; i < BENCH_REQUESTS; i++)
+	{
+		_stprintf_s (usr, _T("visitor%d"), i % BENCH_VISITORS);
+		pwk->SetUserId (usr);
+		pwk->TrackEvent (L"/benchmark", L"Benchmark", L"Send", L"Call", (float) i);
+	}
+	pwk->Shutdown (600000);
+	t1 = ReadClock ();
+
+	sts = pwk->GetStatistics ();
+	lps = lpb.CurrentLoopbackStatistics ();
+
+	printf ("%2d lanes: %9.0f requests/s, %6d exchanges, %lld of %lld sent\n", lns,
+			(double) sts.Acknowledged * 1000000 / ElapsedMicroseconds (t0, t1), lps.Exchanges, sts.Acknowledged, sts.Tracked);
+
+	delete pwk;
+}
+
+// The hand-over of requests from tracking threads to the service alone. The baseline is the path the ring replaced:
+// a kernel mutex guarding a deque, into which every call copies its request, and out of which the service takes 
+// one request per acquisition. The ring has the requests moved in and out, and the service drains it in runs.
+
+struct PiwikHandover
+{
+	PiwikQueue<string>* Ring;
+	HANDLE Mutex;
+	std::deque<string> Requests;
+	int Total;
+};
+
+static unsigned __stdcall ProducerThread (void* p)
+{
+	PiwikHandover* ho = (PiwikHandover*) p;
+	string qry;
+
+	for (int i = 0; i < BENCH_EVENTS; i++)
+	{
+		qry = BENCH_QUERY;
+		if (ho->Ring)
+		{
+			while (! ho->Ring->Push (qry))
+				::SwitchToThread ();
+		}
+		else
+		{
+			::WaitForSingleObject (ho->Mutex, INFINITE);
+			ho->Requests.push_back (qry);
+			::ReleaseMutex (ho->Mutex);
+		}
+	}
+
+	return 0;
+}
+
+static unsigned __stdcall ConsumerThread (void* p)
+{
+	PiwikHandover* ho = (PiwikHandover*) p;
+	string bfr[PIWIK_POST_BUNDLE];
+	int n, cnt = 0;
+
+	while (cnt < ho->Total)
+	{
+		if (ho->Ring)
+			n = ho->Ring->Pop (bfr, PIWIK_POST_BUNDLE);
+		else
+		{
+			::WaitForSingleObject (ho->Mutex, INFINITE);
+			if ((n = (ho->Requests.empty () ? 0 : 1)) > 0)
+			{
+				bfr[0] = ho->Requests.front ();
+				ho->Requests.pop_front ();
+			}
+			::ReleaseMutex (ho->Mutex);
+		}
+
+		if (n == 0)
+			::SwitchToThread ();
+		cnt += n;
+	}
+
+	return 0;
+}
+
+static void RunHandover (int thr, bool rng)
+{
+	PiwikHandover ho;
+	std::vector<HANDLE> hnd;
+	LONGLONG t0, t1;
+
+	ho.Ring = (rng ? new PiwikQueue<string> (PIWIK_QUEUE_CAPACITY) : 0);
+	ho.Mutex = (rng ? 0 : ::CreateMutex (0, FALSE, 0));
+	ho.Total = thr * BENCH_EVENTS;
+
+	t0 = ReadClock ();
+	hnd.push_back ((HANDLE) _beginthreadex (0, 0, ConsumerThread, &ho, 0, 0));
+	for (int i = 0; i < thr; i++)
+		hnd.push_back ((HANDLE) _beginthreadex (0, 0, ProducerThread, &ho, 0, 0));
+	::WaitForMultipleObjects ((DWORD) hnd.size (), &hnd[0], TRUE, INFINITE);
+	t1 = ReadClock ();
+
+	for (size_t i = 0; i < hnd.size (); i++)
+		::CloseHandle (hnd[i]);
+
+	printf ("%2d threads, %-12s %10.0f requests/s\n", thr, (rng ? "ring:" : "mutex+deque:"), (double) ho.Total * 1000000 / ElapsedMicroseconds (t0, t1));
+
+	delete ho.Ring;
+	if (ho.Mutex)
+		::CloseHandle (ho.Mutex);
+}
+
+// A minimal HTTP server on the loopback interface, answering every bulk request like Piwik does.
+// Each connection is served by a thread of its own and kept alive as long as the client wants.
+
+static bool ReadMore (SOCKET s, string& inp)
+{
+	char bfr[8192];
+	int n = ::recv (s, bfr, sizeof bfr, 0);
+
+	if (n > 0)
+		inp.append (bfr, n);
+
+	return (n > 0);
+}
+
+static unsigned __stdcall ConnectionThread (void* p)
+{
+	SOCKET s = (SOCKET) (DWORD_PTR) p;
+	string inp;
+	char rsp[256], ans[128];
+	size_t end, lng, pos;
+	int n, cnt;
+
+	while (1)
+	{
+		while ((end = inp.find ("\r\n\r\n")) == string::npos)
+			if (! ReadMore (s, inp))
+				break;
+		if (end == string::npos)
+			break;
+
+		for (lng = 0, pos = inp.find ("\r\n"); pos < end; pos = inp.find ("\r\n", pos + 2))
+			if (_strnicmp (inp.c_str () + pos + 2, "Content-Length:", 15) == 0)
+				lng = (size_t) atoi (inp.c_str () + pos + 17);
+		end += 4;
+
+		while (inp.size () < end + lng)
+			if (! ReadMore (s, inp))
+				break;
+		if (inp.size () < end + lng)
+			break;
+
+		// every query of a bulk request starts a JSON string with "?"
+		for (cnt = 0, pos = inp.find ("\"?", end); pos < end + lng; pos = inp.find ("\"?", pos + 2))
+			cnt++;
+		inp.erase (0, end + lng);
+
+		n = sprintf_s (ans, sizeof ans, "{\"status\":\"success\",\"tracked\":%d,\"invalid\":0}", cnt);
+		n = sprintf_s (rsp, sizeof rsp, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s", n, ans);
+		if (::send (s, rsp, n, 0) != n)
+			break;
+	}
+
+	::closesocket (s);
+	return 0;
+}
+
+static unsigned __stdcall ServerThread (void* p)
+{
+	SOCKET lsn = (SOCKET) (DWORD_PTR) p;
+	SOCKET s;
+
+	while ((s = ::accept (lsn, 0, 0)) != INVALID_SOCKET)
+		::CloseHandle ((HANDLE) _beginthreadex (0, 0, ConnectionThread, (void*) (DWORD_PTR) s, 0, 0));
+
+	return 0;
+}
+
+static SOCKET StartServer ()
+{
+	SOCKET lsn = ::socket (AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in adr;
+
+	memset (&adr, 0, sizeof adr);
+	adr.sin_family = AF_INET;
+	adr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	adr.sin_port = htons (BENCH_PORT);
+	if (lsn == INVALID_SOCKET || ::bind (lsn, (sockaddr*) &adr, sizeof adr) != 0 || ::listen (lsn, SOMAXCONN) != 0)
+	{
+		printf ("Could not listen on port %d\n", BENCH_PORT);
+		return INVALID_SOCKET;
+	}
+
+	::CloseHandle ((HANDLE) _beginthreadex (0, 0, ServerThread, (void*) (DWORD_PTR) lsn, 0, 0));
+
+	return lsn;
+}
+
+// Full bundles sent to the local server through the given transport (0 for WinHTTP), one exchange after the other;
+// the server answers at once, so this is the cost of the transport itself. The in-process loopback transport,
+// which never reaches the server, gives the cost of the rest of the pipeline.
+
+static void RunTransport (const char* nam, PiwikTransport* t)
+{
+	PiwikClient* pwk = CreateClient (t);
+	PiwikStatistics sts;
+	LONGLONG t0, t1;
+
+	pwk->SetApiUrl (BENCH_LOCAL_URL);
+
+	t0 = ReadClock ();
+	for (int i = 0; i < BENCH_EVENTS; i++)
+		pwk->TrackEvent (L"/benchmark", L"Benchmark", L"Transport", L"Call", (float) i);
+	pwk->Shutdown (600000);
+	t1 = ReadClock ();
+
+	sts = pwk->GetStatistics ();
+
+	printf ("%-10s %9.0f requests/s, %lld of %lld sent\n", nam, (double) sts.Acknowledged * 1000000 / ElapsedMicroseconds (t0, t1), sts.Acknowledged, sts.Tracked);
+
+	delete pwk;
+}
+
+int main ()
+{
+	WSADATA wsd;
+	SOCKET lsn;
+	PiwikSocketTransport sck;
+	PiwikLoopbackTransport lpb;
+
+	printf ("Handing requests over to the service from concurrent threads, baseline and ring\n");
+	for (int thr = 1; thr <= 8; thr *= 2)
+	{
+		RunHandover (thr, false);
+		RunHandover (thr, true);
+	}
+
+	printf ("Tracking calls from concurrent threads\n");
+	for (int thr = 1; thr <= 8; thr *= 2)
+		RunTracking (thr);
+
+	printf ("Sending to a server answering after %d msec, %d visitors\n", BENCH_LATENCY, BENCH_VISITORS);
+	for (int lns = 1; lns <= 16; lns *= 2)
+		RunSending (lns);
+
+	if (::WSAStartup (MAKEWORD (2, 2), &wsd) == 0 && (lsn = StartServer ()) != INVALID_SOCKET)
+	{
+		printf ("Sending %d requests over the loopback interface, by transport\n", BENCH_EVENTS);
+		RunTransport ("WinHTTP", 0);
+		RunTransport ("Sockets", &sck);
+		RunTransport ("In-process", &lpb);
+		::closesocket (lsn);
+	}
+
+	return 0;
+}
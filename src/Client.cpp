@@ -13,6 +13,10 @@
 
 #include "Config.h"
 #include "Utilities.h"
+#include "Queue.h"
+#include "Compressor.h"
+#include "Journal.h"
+#include "Transport.h"
 #include "State.h"
 #include "Dispatcher.h"
 #include "Client.h"
@@ -25,9 +29,15 @@ PiwikClient::PiwikClient (LPCTSTR url, int id)
 	SetSiteId (id);
 	State.ScreenRes = GetScreenResolution ();
 	SetLocation (_T(""));
+	Persistent = Disabled = false; 
+	InstallId = MakeRandomValue ();
+	SetInstallVisitor ();
 	SessionStart = 0; 
 	SessionTimeout = PIWIK_SESSION_TIMEOUT;
-	Persistent = Disabled = false; 
+	Opener = 0;
+	::InitializeConditionVariable (&Opened);
+	for (int i = 0; i < PIWIK_TRACK_KINDS; i++)
+		Priorities[i] = PIWIK_PRIORITY_AUTO;
 	srand ((int) time (0));
 }
 
@@ -43,7 +53,7 @@ void PiwikClient::SetSiteId (int id)
 
 TSTRING PiwikClient::CurrentUserId ()
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return State.UserId; 
 }
@@ -53,7 +63,38 @@ void PiwikClient::SetUserId (LPCTSTR p)
 	PiwikScopedLock lck (Mutex);
 	
 	State.UserId = p; 
-	State.VisitorId = MakeHexDigest (State.UserId, PIWIK_DIGEST_LENGTH);
+	if (State.UserId.empty ())
+		SetInstallVisitor ();
+	else
+	{
+		State.VisitorId = MakeHexDigest (State.UserId, PIWIK_DIGEST_LENGTH);
+		Sampler.SetVisitor (State.VisitorId);
+	}
+}
+
+// Without a user ID, the visitor is the installation: a random ID, so that sampling and the endpoint ring spread 
+// anonymous installations instead of treating them all as one visitor. It lasts for the run only, unless persistent 
+// mode is on and an application name is known: only then is it kept in the registry. Called with the lock held.
+
+void PiwikClient::SetInstallVisitor ()
+{
+	TCHAR bfr[24];
+
+	if (Persistent && ! Application.empty ())
+	{
+		ULONGLONG id = (ULONGLONG) ReadRegistryValue (Application.c_str (), _T(""), _T("VisitorId"));
+		if (id != 0)
+			InstallId = id;
+		else
+			WriteRegistryValue (Application.c_str (), _T(""), _T("VisitorId"), (_int64) InstallId);
+	}
+
+	if (State.UserId.empty ())
+	{
+		_stprintf_s (bfr, _T("%016I64x"), InstallId);
+		State.VisitorId = bfr;
+		Sampler.SetVisitor (State.VisitorId);
+	}
 }
 
 TSTRING PiwikClient::CurrentApiUrl ()  
@@ -66,6 +107,15 @@ bool PiwikClient::SetApiUrl (LPCTSTR p)
 	return Dispatcher.SetApiUrl (p);
 }
 
+// Several endpoints can share the tracking load: every visitor is assigned to one of them by a consistent hash
+// of the visitor ID, so that all requests of a visitor reach the same endpoint. Without a user ID the visitor ID
+// is the random one of the installation, so that anonymous installations are spread as well
+
+bool PiwikClient::SetApiUrls (LPCTSTR* urls, int cnt)
+{
+	return Dispatcher.SetApiUrls (urls, cnt);
+}
+
 int PiwikClient::CurrentRequestMethod ()
 {
 	return Dispatcher.CurrentRequestMethod ();
@@ -88,7 +138,7 @@ void PiwikClient::SetSecureConnection (bool f)
 
 TSTRING PiwikClient::CurrentUserAgent ()  
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return State.UserAgent; 
 }
@@ -102,7 +152,7 @@ void PiwikClient::SetUserAgent (LPCTSTR p)
 	
 TSTRING PiwikClient::CurrentLanguage ()  
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return State.Language; 
 }
@@ -131,7 +181,7 @@ void PiwikClient::SetUserVariable (LPCTSTR nam, LPCTSTR val, int ind)
 
 TSTRING PiwikClient::CurrentApplication ()  
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return Application; 
 }
@@ -141,13 +191,14 @@ void PiwikClient::SetApplication (LPCTSTR p)
 	PiwikScopedLock lck (Mutex);
 	
 	Application = p; 
+	SetInstallVisitor ();
 }
 
 // Location will be prefixed to any tracked URLs not absolute
 
 TSTRING PiwikClient::CurrentLocation ()  
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return Location; 
 }
@@ -166,13 +217,55 @@ bool PiwikClient::SetSessionTimeout (int t)
 	return (t > 0 && (SessionTimeout = t));
 }
 
+// Compression applies to bulk POST requests of at least thr bytes, which are sent gzip or deflate encoded.
+// The level (1-9) trades CPU time for size.
+
+void PiwikClient::SetCompression (PiwikCompression c, int lvl, int thr)
+{
+	Dispatcher.SetCompression (c, lvl, thr);
+}
+
 void PiwikClient::SetConnectionTimeout (int t)
 {
 	Dispatcher.SetConnectionTimeout (t);
 }
 
+// Connections to the server are kept alive between requests and closed after being idle for that many seconds.
+// With WinHTTP this applies to connect handles, while the sockets underneath are kept alive by WinHTTP itself.
+
+void PiwikClient::SetConnectionIdleTimeout (int t)
+{
+	Dispatcher.SetConnectionIdleTimeout (t);
+}
+
+// Concurrency is the number of bundles that may be in flight at the same time, each one sent by a thread of its own.
+// Requests of the same visitor are always sent one after the other, so only a client tracking several visitors in turn,
+// or replaying the journal of such a client, gains from more than one lane. Has to be set before tracking starts.
+
+bool PiwikClient::SetConcurrency (int n)
+{
+	return Dispatcher.SetConcurrency (n);
+}
+
+// The asynchronous transport sends requests without blocking any thread of the client: every exchange is driven
+// by WinHTTP callbacks on the system's thread pool, and concurrency sets how many may be under way.
+// Has to be set before tracking starts.
+
+bool PiwikClient::SetAsyncTransport (bool v)
+{
+	return Dispatcher.SetAsyncTransport (v);
+}
+
+// Requests may be carried by another transport than WinHTTP, e.g. plain sockets or an in-process loopback
+// for measurements without a server. The transport stays with the caller. Has to be set before tracking starts.
+
+bool PiwikClient::SetTransport (PiwikTransport* t)
+{
+	return Dispatcher.SetTransport (t);
+}
+
 // Dispatch interval determines the network strategy as follows:
-// - if positive, it will batch all submitted requests that many seconds before sending them to the server
+// - if positive, it will batch submitted requests for at most that many seconds before sending them to the server
 // - if negative, it will disable automatic sending and will require explicit flush
 // - if zero, it will cause requests to be sent immediately after submission
 
@@ -181,12 +274,124 @@ void PiwikClient::SetDispatchInterval (int t)
 	Dispatcher.SetDispatchInterval (t);
 }
 
+// Retry policy determines how requests failing for transient reasons (no connection, server errors) are handled:
+// they are resent up to lmt times, waiting dly seconds before the first retry and doubling the delay each time up to max
+
+void PiwikClient::SetRetryPolicy (int lmt, int dly, int max)
+{
+	Dispatcher.SetRetryPolicy (lmt, dly, max);
+}
+
+// Batching sends pending requests as soon as cnt requests or size bytes have gathered, or the oldest one has waited age msec,
+// and limits bundles to the same number of requests and bytes. If adaptive, batches are held back no longer than
+// about two round trips to the server. It only applies when the dispatch interval is positive.
+
+void PiwikClient::SetBatching (int cnt, int size, int age, bool adp)
+{
+	Dispatcher.SetBatching (cnt, size, age, adp);
+}
+
+// Requests per second and bytes per second sent to each endpoint are limited, and lowered further while the server 
+// asks to slow down; requests held back are sent later in larger bundles
+
+void PiwikClient::SetRateLimits (int rps, int bps)
+{
+	Dispatcher.SetRateLimits (rps, bps);
+}
+
+// An endpoint that stops responding is given up for a while instead of costing a timeout for every bundle,
+// and probed with a single request before it is used again
+
+void PiwikClient::SetCircuitBreaker (int lmt, int dly, int max)
+{
+	Dispatcher.SetCircuitBreaker (lmt, dly, max);
+}
+
+// A journal keeps a copy of every pending request in the given file until it has been sent, 
+// so that requests left over by a crash or an interrupted shutdown are sent on the next run
+
+bool PiwikClient::SetJournal (LPCTSTR path, int size)
+{
+	return Dispatcher.SetJournal (path, size);
+}
+
+// Queue limits cap the number and total size of requests waiting to be sent (or retried).
+// When a new request would exceed them, the policy decides which request is dropped, or whether the caller waits 
+// up to wait msec for room before its request is dropped.
+
+void PiwikClient::SetQueueLimits (int cnt, int size, PiwikOverflowPolicy plc, int wait)
+{
+	Dispatcher.SetQueueLimits (cnt, size, plc, wait);
+}
+
+// Only a sample of the visitors is tracked by methods, event categories or event actions with a rate below 1.
+// Requests left out cost nothing more than the decision, and tracking calls return 0 for them.
+
+bool PiwikClient::SetSampleRate (PiwikTrackingKind knd, double rate)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (knd < 0 || knd >= PIWIK_TRACK_KINDS || rate < 0 || rate > 1)
+		return false;
+	Sampler.SetRate (knd, rate);
+
+	return true;
+}
+
+bool PiwikClient::SetSampleRate (LPCTSTR ctg, LPCTSTR act, double rate)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (! ctg || ! *ctg || rate < 0 || rate > 1)
+		return false;
+	Sampler.SetRate (ctg, act, rate);
+
+	return true;
+}
+
+// The rate of sampled requests is reported in the given custom dimension, if any
+
+void PiwikClient::SetSampleDimension (int id)
+{
+	PiwikScopedLock lck (Mutex);
+
+	State.SampleDimension = max (0, id);
+}
+
+// Repeated events are tracked once per window of wnd msec, with their values summed and their number
+// reported in the custom dimension dim, which is required so that no count gets lost. A window of 0 turns aggregation off.
+
+bool PiwikClient::SetAggregation (int wnd, int dim, int keys)
+{
+	return Dispatcher.SetAggregation (wnd, dim, keys);
+}
+
+// Requests are queued by priority, which is derived from what they track unless set for their tracking method
+// (or in the state passed to Track). More important requests are sent first and dropped last.
+
+bool PiwikClient::SetPriority (PiwikTrackingKind knd, PiwikPriority p)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (knd < 0 || knd >= PIWIK_TRACK_KINDS || p < PIWIK_PRIORITY_AUTO || p >= PIWIK_PRIORITY_LEVELS)
+		return false;
+	Priorities[knd] = p;
+
+	return true;
+}
+
+bool PiwikClient::SetPriorityWeight (PiwikPriority p, int w)
+{
+	return Dispatcher.SetPriorityWeight (p, w);
+}
+
 void PiwikClient::StartNewSession ()              
 { 
 	SessionStart = 0; 
 }
 
-// Persistent mode will try to store statistical data for this user in the registry
+// Persistent mode will try to store statistical data for this user in the registry, 
+// and the random visitor ID of the installation, which is otherwise kept for the run only
 
 bool PiwikClient::IsPersistent ()                     
 { 
@@ -195,7 +400,11 @@ bool PiwikClient::IsPersistent ()
 
 void PiwikClient::SetPersistent (bool v)              
 { 
+	PiwikScopedLock lck (Mutex);
+	
 	Persistent = v; 
+	if (Persistent)
+		SetInstallVisitor ();
 }
 
 // Disabling the client will cause all tracking requests to be ignored
@@ -229,6 +438,66 @@ void PiwikClient::SetLogger (wostream* s, PiwikLogLevel lvl)
 	Dispatcher.SetLogger (s, lvl);
 }
 
+// Lock statistics sum up the acquisitions, contentions and wait times of all locks used by this client
+
+void PiwikClient::GetLockStatistics (PiwikLockStatistics& sts)
+{
+	sts = PiwikLockStatistics ();
+	Mutex.CollectStatistics (sts);
+	Logger.CollectLockStatistics (sts);
+	Dispatcher.CollectLockStatistics (sts);
+}
+
+void PiwikClient::ResetLockStatistics ()
+{
+	Mutex.ResetStatistics ();
+	Logger.ResetLockStatistics ();
+	Dispatcher.ResetLockStatistics ();
+}
+
+// Connection statistics tell how many connections were opened, how many requests reused one and how many were closed as idle
+
+PiwikConnectionStatistics PiwikClient::CurrentConnectionStatistics ()
+{
+	return Dispatcher.CurrentConnectionStatistics ();
+}
+
+// Compression statistics sum up the number of compressed bundles, their sizes before and after and the time spent
+
+PiwikCompressionStatistics PiwikClient::CurrentCompressionStatistics ()
+{
+	return Dispatcher.CurrentCompressionStatistics ();
+}
+
+// Queue statistics tell how many requests and bytes are pending, their peak levels, and how many were dropped or had to wait
+
+PiwikQueueStatistics PiwikClient::CurrentQueueStatistics ()
+{
+	return Dispatcher.CurrentQueueStatistics ();
+}
+
+// Endpoint statistics tell, for every endpoint used, how many requests were routed to it and what became of them
+
+std::vector<PiwikEndpointStatistics> PiwikClient::CurrentEndpointStatistics ()
+{
+	return Dispatcher.CurrentEndpointStatistics ();
+}
+
+// Latency statistics give the distributions of queuing delays, round trips, bundle sizes and serialization times,
+// optionally starting them anew
+
+PiwikLatencyStatistics PiwikClient::CurrentLatencyStatistics (bool rst)
+{
+	return Dispatcher.CurrentLatencyStatistics (rst);
+}
+
+// Statistics sum up the whole pipeline, from tracking calls to the exchanges with the server
+
+PiwikStatistics PiwikClient::GetStatistics ()
+{
+	return Dispatcher.CurrentStatistics ();
+}
+
 // Tracking
 
 // TrackEvent: path (PARAM_URL_PATH) is the only required parameter.
@@ -236,8 +505,15 @@ void PiwikClient::SetLogger (wostream* s, PiwikLogLevel lvl)
 
 int PiwikClient::TrackEvent (LPCTSTR path, LPCTSTR ctg, LPCTSTR act, LPCTSTR nam, float val)
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_EVENT, ctg, act, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_EVENT;
 	st.TrackedPath = path;
 	if (ctg)
 		st.EventCategory = ctg;
@@ -258,8 +534,15 @@ int PiwikClient::TrackScreen (LPCTSTR path, LPCTSTR act, int amountOfTime, LPCTS
 		                         LPCTSTR nam3, LPCTSTR val3, LPCTSTR nam4, LPCTSTR val4, LPCTSTR nam5, LPCTSTR val5,
                                  LPCTSTR nam6, LPCTSTR val6, LPCTSTR nam7, LPCTSTR val7, LPCTSTR nam8, LPCTSTR val8 )
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_SCREEN, 0, act, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_SCREEN;
 	st.TrackedPath = path;
 	if (act)
 		st.TrackedAction = act;
@@ -304,8 +587,15 @@ void PiwikClient::SetVisitDimensions (int nDimensionNum, ...)
 
 int PiwikClient::TrackAction( LPCTSTR path, LPCTSTR act, int amountOfTime, int nDimensionNum, ... )
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_ACTION, 0, act, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_ACTION;
 	st.TrackedPath = path;
 	st.TrackedAction = act;
 
@@ -334,8 +624,15 @@ int PiwikClient::TrackAction( LPCTSTR path, LPCTSTR act, int amountOfTime, int n
 
 int PiwikClient::TrackGoal (LPCTSTR path, int goal, float rev)
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_GOAL, 0, 0, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_GOAL;
 	st.TrackedPath = path;
 	st.Goal = goal;
 	st.Revenue = rev;
@@ -347,8 +644,15 @@ int PiwikClient::TrackGoal (LPCTSTR path, int goal, float rev)
 
 int PiwikClient::TrackOutLink (LPCTSTR path)
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_OUTLINK, 0, 0, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_OUTLINK;
 	st.TrackedPath = path;
 	st.OutLink = path;
 
@@ -359,8 +663,15 @@ int PiwikClient::TrackOutLink (LPCTSTR path)
 
 int PiwikClient::TrackImpression (LPCTSTR path, LPCTSTR content, LPCTSTR piece, LPCTSTR target)
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_IMPRESSION, 0, 0, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_IMPRESSION;
 	st.TrackedPath = path;
 	if (content)
 		st.ContentName = content;
@@ -376,8 +687,15 @@ int PiwikClient::TrackImpression (LPCTSTR path, LPCTSTR content, LPCTSTR piece,
 
 int PiwikClient::TrackInteraction (LPCTSTR path, LPCTSTR content, LPCTSTR piece, LPCTSTR target, LPCTSTR action)
 {
+	float rate;
+
+	if (! Sample (PIWIK_TRACK_INTERACTION, 0, action, rate))
+		return 0;
+
 	PiwikState st;
 
+	st.SampleRate = rate;
+	st.Kind = PIWIK_TRACK_INTERACTION;
 	st.TrackedPath = path;
 	if (content)
 		st.ContentName = content;
@@ -391,16 +709,67 @@ int PiwikClient::TrackInteraction (LPCTSTR path, LPCTSTR content, LPCTSTR piece,
 	return Track (st);
 }
 
+// Decides whether a request is kept by the sampling rates, before anything is spent on it
+
+bool PiwikClient::Sample (PiwikTrackingKind knd, LPCTSTR ctg, LPCTSTR act, float& rate)
+{
+	PiwikSharedLock lck (Mutex);
+	double r = Sampler.Rate (knd, ctg, act);
+
+	rate = (float) r;
+
+	return Sampler.Keep (r);
+}
+
 // Generic tracking routine called by all specific tracking methods.
 // Can also be called directly with a custom constructed state to track more complex events.
 // Returns an integer identifier that can be used to query the outcome of the request.
+// If a completion routine is given, it is called with ctx as soon as that outcome is known.
+// The state is completed from the client's settings under its lock, which is given up before the request is
+// serialized and queued, so that tracking threads only contend for copying those settings.
+// Only a session start holds back the others until it is queued, so that none of its visit gets ahead of it.
+// The time spent is counted, including any wait for the client's lock.
+
+int PiwikClient::Track (PiwikState& st, PiwikCompletion fnc, void* ctx)
+{
+	LONGLONG t0 = ReadClock ();
+	int rsl = 0;
+
+	if (Prepare (st))
+	{
+		Dispatcher.Count (PIWIK_COUNT_TRACKED, 1);
+		rsl = Dispatcher.Submit (st, fnc, ctx);
+		if (st.NewSession)
+			EndOpening ();
+	}
+
+	Dispatcher.Count (PIWIK_COUNT_TRACK_TIME, ReadClock () - t0);
+
+	return rsl;
+}
+
+// Returns false if the state is not to be tracked at all.
+// While a session start is being queued, other threads wait here; the thread queuing it does not, 
+// since a completion routine called right away may track again.
 
-int PiwikClient::Track (PiwikState& st)
+bool PiwikClient::Prepare (PiwikState& st)
 {
 	PiwikScopedLock lck (Mutex);
 
+	while (Opener && Opener != ::GetCurrentThreadId ())
+		Mutex.Await (Opened, INFINITE);
+
 	if (! Disabled && State.SiteId && ! st.TrackedPath.empty ())
 	{
+		// states built by the caller are sampled here, by their kind, event category and action
+		if (st.SampleRate == 0)
+		{
+			double rate = Sampler.Rate (st.Kind, st.EventCategory.c_str (), st.EventAction.c_str ());
+			if (! Sampler.Keep (rate))
+				return false;
+			st.SampleRate = (float) rate;
+		}
+
 		time_t t = time (0);
 		if (t - SessionStart > SessionTimeout)
 		{
@@ -421,6 +790,7 @@ int PiwikClient::Track (PiwikState& st)
 			}
 			
 			SessionStart = t;
+			Opener = ::GetCurrentThreadId ();
 		}
 
 		if (st.TrackedPath.find (':') == TSTRING::npos)
@@ -434,12 +804,31 @@ int PiwikClient::Track (PiwikState& st)
         st.VistDimensionVariables = State.VistDimensionVariables;
 		st.Recording = State.Recording;
 		st.ReturnImage = State.ReturnImage;
+		st.SampleDimension = State.SampleDimension;
+		if (st.Priority == PIWIK_PRIORITY_AUTO)
+			st.Priority = Priorities[st.Kind];
 		st.Random = rand ();
 
-		return Dispatcher.Submit (st); 
+		return true;
 	}
 
-	return 0;
+	if (Disabled)
+		Dispatcher.Count (PIWIK_COUNT_DISABLED, 1);
+
+	return false;
+}
+
+// Lets the requests held back by a session start go on, once the thread that decided on it has queued it
+
+void PiwikClient::EndOpening ()
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (Opener == ::GetCurrentThreadId ())
+	{
+		Opener = 0;
+		::WakeAllConditionVariable (&Opened);
+	}
 }
 
 // Flushing will send all pending requests to the server.
@@ -450,26 +839,37 @@ bool PiwikClient::Flush ()
 	return (! Disabled && Dispatcher.Flush ());
 }
 
+// Shutting down sends all pending requests in full bundles, for at most wait msec. Whatever could not be sent
+// by then is left in the journal, if one is open, to be sent by the next run. No requests are accepted afterwards.
+// This will be called implicitly on destruction, if it has not been before.
+
+PiwikShutdownReport PiwikClient::Shutdown (int wait)
+{
+	return Dispatcher.Shutdown (wait);
+}
+
 // RequestStatus will return a code describing the outcome of a previous request as follows:
-// - positive if the request was successfully acknowledged by the server
-// - negative if the request failed
-// - zero if the outcome is still unknown
-// If a timeout is specified, the function will retry if necessary that many seconds.
+// - positive (PIWIK_STATUS_SENT) if the request was successfully acknowledged by the server
+// - negative if the request failed: PIWIK_STATUS_FAILED if it could not be delivered, PIWIK_STATUS_REJECTED 
+//   if it was rejected by the server, PIWIK_STATUS_DROPPED if it was discarded before being sent
+// - zero (PIWIK_STATUS_PENDING) if the outcome is still unknown
+// - PIWIK_STATUS_PERSISTED if the request was left in the journal at shutdown, to be sent by the next run
+// - PIWIK_STATUS_UNKNOWN if the request is too old for its outcome to be remembered, or was never issued
+// If a timeout is specified, the function will wait at most that many seconds for the outcome to become known.
 
 int PiwikClient::RequestStatus (int rqst, int wait)
 {
-	time_t t = time (0);
-	int vld = 0;
+	if (wait > 0)
+		Dispatcher.AwaitRequests (&rqst, 1, (DWORD) wait * 1000);
 
-	while (1)
-	{
-		vld = Dispatcher.RequestStatus (rqst);
-		if (! vld && wait > 0 && time (0) - t < (wait & 0x3F))
-			Sleep (250);
-		else
-			break;
-	}
+	return Dispatcher.RequestStatus (rqst);
+}
 
-	return vld;
+// Waits until the outcome of all given requests is known, at most for wait seconds (or indefinitely if negative).
+// Returns true if none of them is pending any more.
+
+bool PiwikClient::AwaitRequests (const int* rqst, int cnt, int wait)
+{
+	return Dispatcher.AwaitRequests (rqst, cnt, (wait < 0 ? INFINITE : (DWORD) wait * 1000));
 }
 
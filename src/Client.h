@@ -28,15 +28,25 @@ class PiwikClient
 private:
 	TSTRING Application;
 	TSTRING Location;
+	ULONGLONG InstallId;
 	time_t SessionStart;
 	int SessionTimeout;
 	bool Persistent;
 	bool Disabled;
+	DWORD Opener;
+	CONDITION_VARIABLE Opened;
+	PiwikPriority Priorities[PIWIK_TRACK_KINDS];
 
 	PiwikBasicState State;
+	PiwikSampler Sampler;
 	PiwikDispatcher Dispatcher;
 	PiwikLock Mutex;
 	PiwikLogger Logger;
+
+	bool Sample (PiwikTrackingKind knd, LPCTSTR ctg, LPCTSTR act, float& rate);
+	bool Prepare (PiwikState& st);
+	void EndOpening ();
+	void SetInstallVisitor ();
 	
 public:
 	PiwikClient (LPCTSTR url, int id = 0);
@@ -47,6 +57,7 @@ public:
 	void SetUserId (LPCTSTR p);
 	TSTRING CurrentApiUrl ();
 	bool SetApiUrl (LPCTSTR p);
+	bool SetApiUrls (LPCTSTR* urls, int cnt);
 	int  CurrentRequestMethod ();
 	void SetRequestMethod (PiwikMethod m);
 	bool UsesSecureConnection ();
@@ -61,8 +72,25 @@ public:
 	TSTRING CurrentLocation ();
 	void SetLocation (LPCTSTR p);
 	bool SetSessionTimeout (int t);
+	void SetCompression (PiwikCompression c, int lvl = PIWIK_COMPRESSION_LEVEL, int thr = PIWIK_COMPRESSION_THRESHOLD);
 	void SetConnectionTimeout (int t);
+	void SetConnectionIdleTimeout (int t);
+	bool SetConcurrency (int n);
+	bool SetAsyncTransport (bool v);
+	bool SetTransport (PiwikTransport* t);
 	void SetDispatchInterval (int t);
+	void SetBatching (int cnt, int size = PIWIK_BUNDLE_SIZE, int age = PIWIK_DISPATCH_INTERVAL * 1000, bool adp = true);
+	void SetRetryPolicy (int lmt, int dly = PIWIK_RETRY_DELAY, int max = PIWIK_RETRY_MAX_DELAY);
+	void SetRateLimits (int rps, int bps = PIWIK_BYTE_RATE_LIMIT);
+	void SetCircuitBreaker (int lmt, int dly = PIWIK_BREAKER_COOLDOWN, int max = PIWIK_BREAKER_MAX_COOLDOWN);
+	bool SetJournal (LPCTSTR path, int size = PIWIK_JOURNAL_SIZE);
+	void SetQueueLimits (int cnt, int size = PIWIK_QUEUE_SIZE, PiwikOverflowPolicy plc = PIWIK_OVERFLOW_DROP_PRIORITY, int wait = PIWIK_QUEUE_WAIT);
+	bool SetPriority (PiwikTrackingKind knd, PiwikPriority p);
+	bool SetPriorityWeight (PiwikPriority p, int w);
+	bool SetSampleRate (PiwikTrackingKind knd, double rate);
+	bool SetSampleRate (LPCTSTR ctg, LPCTSTR act, double rate);
+	void SetSampleDimension (int id);
+	bool SetAggregation (int wnd, int dim, int keys = PIWIK_AGGREGATE_DEFAULT);
 	void StartNewSession ();
 	bool IsPersistent ();
 	void SetPersistent (bool v);
@@ -71,6 +99,14 @@ public:
 	bool IsDryRun ();
 	void SetDryRun (bool v);
 	void SetLogger (wostream* s, PiwikLogLevel lvl = PIWIK_INITIAL_LOG_LEVEL);
+	void GetLockStatistics (PiwikLockStatistics& sts);
+	void ResetLockStatistics ();
+	PiwikConnectionStatistics CurrentConnectionStatistics ();
+	PiwikCompressionStatistics CurrentCompressionStatistics ();
+	PiwikQueueStatistics CurrentQueueStatistics ();
+	std::vector<PiwikEndpointStatistics> CurrentEndpointStatistics ();
+	PiwikLatencyStatistics CurrentLatencyStatistics (bool rst = false);
+	PiwikStatistics GetStatistics ();
     void SetVisitDimensions (int nDimensionNum, ...);
 
 	int  TrackEvent (LPCTSTR path, LPCTSTR ctg = 0, LPCTSTR act = 0, LPCTSTR nam = 0, float val = 0);
@@ -85,7 +121,9 @@ public:
 	int  TrackImpression (LPCTSTR path, LPCTSTR content, LPCTSTR piece, LPCTSTR target);
 	int  TrackInteraction (LPCTSTR path, LPCTSTR content, LPCTSTR piece, LPCTSTR target, LPCTSTR action);
 
-	int  Track (PiwikState& st);
+	int  Track (PiwikState& st, PiwikCompletion fnc = 0, void* ctx = 0);
 	bool Flush ();
+	PiwikShutdownReport Shutdown (int wait = PIWIK_SHUTDOWN_WAIT * 1000);
 	int  RequestStatus (int rqst, int wait = 0);
+	bool AwaitRequests (const int* rqst, int cnt, int wait = -1);
 };
@@ -0,0 +1,231 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Compressor.cpp
+// Description:  Implementation of the PiwikCompressor class encoding request bodies as gzip or deflate streams
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Config.h"
+#include "Utilities.h"
+#include "Compressor.h"
+
+// Base values and extra bits of the length (257-285) and distance (0-29) codes
+
+static const int LengthBase[29]    = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const int LengthExtra[29]   = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const int DistanceBase[30]  = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                       4097, 6145, 8193, 12289, 16385, 24577 };
+static const int DistanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+// Huffman codes are sent starting from their most significant bit, while all other fields are packed from
+// the least significant one: the fixed codes are therefore stored bit-reversed, ready to be packed.
+
+static unsigned int ReverseBits (unsigned int val, int cnt)
+{
+	unsigned int r = 0;
+
+	while (cnt-- > 0)
+		r = (r << 1) | (val & 1), val >>= 1;
+
+	return r;
+}
+
+PiwikCompressor::PiwikCompressor ()
+: BitBuffer(0), BitCount(0), Output(0)
+{
+	unsigned int c;
+	int i;
+
+	for (i = 0; i < 288; i++)
+	{
+		if (i < 144)
+			c = 0x30 + i, Lengths[i] = 8;
+		else if (i < 256)
+			c = 0x190 + i - 144, Lengths[i] = 9;
+		else if (i < 280)
+			c = i - 256, Lengths[i] = 7;
+		else
+			c = 0xC0 + i - 280, Lengths[i] = 8;
+		Codes[i] = (unsigned short) ReverseBits (c, Lengths[i]);
+	}
+}
+
+// Compresses src into trg using the given format and level (1-9).
+// Returns false if no compression was requested, leaving trg empty.
+
+bool PiwikCompressor::Compress (const string& src, string& trg, PiwikCompression frmt, int lvl)
+{
+	const unsigned char* data = (const unsigned char*) src.data ();
+	int n = (int) src.size ();
+	LARGE_INTEGER t0, t1, frq;
+
+	trg.clear ();
+	if (frmt == PIWIK_COMPRESSION_NONE)
+		return false;
+
+	::QueryPerformanceCounter (&t0);
+
+	trg.reserve (n / 4 + 64);
+	Output = &trg;
+	BitBuffer = 0, BitCount = 0;
+
+	if (frmt == PIWIK_COMPRESSION_GZIP)
+	{
+		// magic, method, no flags, no modification time, no extra flags, unknown OS
+		const char hdr[10] = { '\x1F', '\x8B', 8, 0, 0, 0, 0, 0, 0, '\xFF' };
+		trg.append (hdr, sizeof hdr);
+	}
+	else
+	{
+		// 32K window, no dictionary, header check bits making the first two bytes divisible by 31
+		trg.push_back ('\x78');
+		trg.push_back ('\x01');
+	}
+
+	Deflate (data, n, lvl);
+
+	if (frmt == PIWIK_COMPRESSION_GZIP)
+	{
+		PutWord (ComputeCrc32 (data, n), false);
+		PutWord ((unsigned int) n, false);
+	}
+	else
+		PutWord (Adler32 (data, n), true);
+
+	Output = 0;
+
+	::QueryPerformanceCounter (&t1);
+	::QueryPerformanceFrequency (&frq);
+
+	Statistics.Batches++;
+	Statistics.BytesIn += n;
+	Statistics.BytesOut += trg.size ();
+	Statistics.Time += (_int64) ((t1.QuadPart - t0.QuadPart) * 1000000.0 / frq.QuadPart);
+
+	return true;
+}
+
+// Greedy LZ77 parse: at each position the longest match found within the allowed chain depth is taken
+
+void PiwikCompressor::Deflate (const unsigned char* data, int n, int lvl)
+{
+	int chain = 4 << (lvl < 1 ? 1 : (lvl > 9 ? 9 : lvl));
+	int i, k, cnd, lng, lim, bst, dst = 0;
+
+	if (Head.empty ())
+	{
+		Head.resize (HashSize);
+		Prev.resize (WindowSize);
+	}
+	std::fill (Head.begin (), Head.end (), -1);
+
+	PutBits (1, 1);    // last block
+	PutBits (1, 2);    // fixed Huffman codes
+
+	for (i = 0; i < n; )
+	{
+		bst = 0;
+		if (i + 3 <= n)
+		{
+			lim = min (n - i, (int) MaxMatch);
+			for (cnd = Head[(data[i] << 10 ^ data[i + 1] << 5 ^ data[i + 2]) & (HashSize - 1)], k = chain;
+				 cnd >= 0 && i - cnd <= WindowSize && k > 0; cnd = Prev[cnd & (WindowSize - 1)], k--)
+			{
+				if (data[cnd + bst] != data[i + bst])
+					continue;
+				for (lng = 0; lng < lim && data[cnd + lng] == data[i + lng]; lng++)
+					;
+				if (lng > bst)
+				{
+					bst = lng, dst = i - cnd;
+					if (lng == lim)
+						break;
+				}
+			}
+		}
+
+		if (bst >= 3)
+		{
+			PutMatch (bst, dst);
+			for (k = 0; k < bst; k++, i++)
+				if (i + 3 <= n)
+					Insert (data, i);
+		}
+		else
+		{
+			PutSymbol (data[i]);
+			if (i + 3 <= n)
+				Insert (data, i);
+			i++;
+		}
+	}
+
+	PutSymbol (256);
+	if (BitCount > 0)
+		Output->push_back ((char) (BitBuffer & 0xFF)), BitBuffer = 0, BitCount = 0;
+}
+
+// Links the position into the hash chain of the three bytes starting there
+
+void PiwikCompressor::Insert (const unsigned char* data, int pos)
+{
+	int h = (data[pos] << 10 ^ data[pos + 1] << 5 ^ data[pos + 2]) & (HashSize - 1);
+
+	Prev[pos & (WindowSize - 1)] = Head[h];
+	Head[h] = pos;
+}
+
+void PiwikCompressor::PutBits (unsigned int val, int cnt)
+{
+	BitBuffer |= val << BitCount;
+	BitCount += cnt;
+	while (BitCount >= 8)
+	{
+		Output->push_back ((char) (BitBuffer & 0xFF));
+		BitBuffer >>= 8;
+		BitCount -= 8;
+	}
+}
+
+void PiwikCompressor::PutMatch (int lng, int dst)
+{
+	int c;
+
+	for (c = 28; LengthBase[c] > lng; c--)
+		;
+	PutSymbol (257 + c);
+	PutBits (lng - LengthBase[c], LengthExtra[c]);
+
+	for (c = 29; DistanceBase[c] > dst; c--)
+		;
+	PutBits (ReverseBits (c, 5), 5);
+	PutBits (dst - DistanceBase[c], DistanceExtra[c]);
+}
+
+void PiwikCompressor::PutWord (unsigned int val, bool msb)
+{
+	for (int i = 0; i < 4; i++)
+		Output->push_back ((char) (msb ? val >> (24 - i * 8) : val >> (i * 8)));
+}
+
+unsigned int PiwikCompressor::Adler32 (const unsigned char* data, int n)
+{
+	unsigned int a = 1, b = 0;
+	int i, k;
+
+	// sums are reduced every 5552 bytes, the largest run that cannot overflow 32 bits
+	for (i = 0; i < n; )
+	{
+		for (k = min (n - i, 5552); k > 0; k--, i++)
+			a += data[i], b += a;
+		a %= 65521, b %= 65521;
+	}
+
+	return (b << 16) | a;
+}
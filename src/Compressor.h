@@ -0,0 +1,68 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Compressor.h
+// Description:  Definition of the PiwikCompressor class encoding request bodies as gzip or deflate streams
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <windows.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Compression statistics, accumulated since the compressor was created (times in microseconds)
+
+struct PiwikCompressionStatistics
+{
+	int Batches;
+	_int64 BytesIn;
+	_int64 BytesOut;
+	_int64 Time;
+
+	PiwikCompressionStatistics () : Batches(0), BytesIn(0), BytesOut(0), Time(0) {}
+};
+
+// Minimal deflate encoder (RFC 1951) emitting a single block with fixed Huffman codes.
+// Matches are searched over a 32K window through hash chains whose depth grows with the compression level.
+// The output is wrapped either as gzip (RFC 1952) or as zlib (RFC 1950), the format HTTP calls "deflate".
+// Tables are kept between calls, so an instance is meant to be reused by a single thread.
+
+class PiwikCompressor
+{
+private:
+	enum { WindowSize = 32768, HashSize = 32768, MaxMatch = 258 };
+
+	std::vector<int> Head;
+	std::vector<int> Prev;
+	unsigned short Codes[288];
+	unsigned char Lengths[288];
+	unsigned int BitBuffer;
+	int BitCount;
+	string* Output;
+	PiwikCompressionStatistics Statistics;
+
+public:
+	PiwikCompressor ();
+
+	PiwikCompressionStatistics CurrentStatistics ()   { return Statistics; }
+
+	bool Compress (const string& src, string& trg, PiwikCompression frmt, int lvl);
+
+private:
+	void Deflate (const unsigned char* data, int n, int lvl);
+	void Insert (const unsigned char* data, int pos);
+	void PutBits (unsigned int val, int cnt);
+	void PutSymbol (int sym)                      { PutBits (Codes[sym], Lengths[sym]); }
+	void PutMatch (int lng, int dst);
+	void PutWord (unsigned int val, bool msb);
+	unsigned int Adler32 (const unsigned char* data, int n);
+};
@@ -25,9 +25,38 @@
 #define PIWIK_DIGEST_LENGTH        16
 #define PIWIK_SESSION_TIMEOUT      (30 * 60)  // sec before restarting a client session
 #define PIWIK_CONNECTION_TIMEOUT   5          // sec while trying to establish a connection
+#define PIWIK_RESPONSE_TIMEOUT     30         // sec while sending a request or waiting for the response
+#define PIWIK_CONNECTION_IDLE_TIMEOUT  (5 * 60)  // sec before closing an unused keep-alive connection
 #define PIWIK_DISPATCH_INTERVAL    (2 * 60)   // sec between API requests
+#define PIWIK_RETRY_LIMIT          5          // number of times a request is resent after a transient failure
+#define PIWIK_RETRY_DELAY          2          // sec before the first retry, doubled with every further attempt
+#define PIWIK_RETRY_MAX_DELAY      (5 * 60)   // sec at most between two retries
+#define PIWIK_JOURNAL_SIZE         (4 << 20)  // bytes of a newly created request journal file
+#define PIWIK_JOURNAL_SYNC         1000       // msec at most before journaled requests are written to disk
 #define PIWIK_SHUTDOWN_WAIT        10         // sec waiting for last pending requests to be sent
+#define PIWIK_SHUTDOWN_GRACE       1000       // msec granted after the shutdown deadline to asynchronous exchanges still under way
 #define PIWIK_POST_BUNDLE          50         // number of queries sent together in one POST request
+#define PIWIK_BUNDLE_SIZE          (256 << 10) // bytes of queries sent together in one POST request
+#define PIWIK_CONCURRENCY          1          // number of bundles that can be in flight at the same time
+#define PIWIK_BATCH_LINGER         50         // msec at least waited for further requests when adapting to the round-trip time
+#define PIWIK_COMPRESSION_LEVEL    6          // deflate effort (1-9) when compressing bulk requests
+#define PIWIK_COMPRESSION_THRESHOLD  1024     // bytes below which bulk requests are sent uncompressed
+#define PIWIK_QUEUE_CAPACITY       4096       // number of requests that can be pending at the same time
+#define PIWIK_QUEUE_SIZE           (8 << 20)  // bytes of queries that can be pending at the same time
+#define PIWIK_PRIORITY_WEIGHT      2          // factor between the shares of bundles given to successive priority classes
+#define PIWIK_QUEUE_WAIT           1000       // msec a tracking call may wait for room in the queue when blocking
+#define PIWIK_STATUS_CAPACITY      16384      // number of most recent requests whose outcome can be queried
+#define PIWIK_ENDPOINT_CAPACITY    256        // number of distinct endpoints requests can be sent to during a run
+#define PIWIK_SHARD_POINTS         64         // points each endpoint of a set owns on the consistent hash ring
+#define PIWIK_RING_GRACE           1000       // msec a replaced hash ring is kept for tracking calls still routing through it
+#define PIWIK_OPENING_SLOTS        256        // groups of visitors whose pending session starts are counted apart
+#define PIWIK_RATE_LIMIT           0          // exchanges per second sent to an endpoint at most (0 for no limit)
+#define PIWIK_BYTE_RATE_LIMIT      0          // bytes per second sent to an endpoint at most (0 for no limit)
+#define PIWIK_BREAKER_THRESHOLD    5          // consecutive exchanges with an endpoint failing without response before it is given up for a while
+#define PIWIK_BREAKER_COOLDOWN     5          // sec before the first probe of an endpoint given up, doubled with every failed probe
+#define PIWIK_BREAKER_MAX_COOLDOWN (5 * 60)   // sec at most between two probes
+#define PIWIK_MAX_SLOWDOWN         64         // factor the rate limits are divided by at most while the server asks to slow down
+#define PIWIK_AGGREGATION_WINDOW   0          // msec identical events are gathered before being tracked as one (0 for none)
 #define PIWIK_RECORDING_VALUE      1          // rec parameter value
 #define PIWIK_SEND_IMAGE           0          // send_image parameter value
 
@@ -37,7 +66,7 @@
 // Target Operating System Version
 
 #ifndef _WIN32_WINNT
-#define _WIN32_WINNT 0x0501
+#define _WIN32_WINNT 0x0601
 #endif
 
 // If the Piwik server is in debug mode the network module will read the information responses
@@ -13,56 +13,171 @@
 
 #include "Config.h"
 #include "Utilities.h"
+#include "Queue.h"
+#include "Compressor.h"
+#include "Journal.h"
+#include "Transport.h"
 #include "State.h"
+#include "QueryParams.h"
 #include "Dispatcher.h"
 
 // Configuration
 
 PiwikDispatcher::PiwikDispatcher ()
-: Session(0)
+: Outcomes(PIWIK_STATUS_CAPACITY), Session(0), Transport(0)
 {
+	for (int p = 0; p < PIWIK_PRIORITY_LEVELS; ++p)
+	{
+		Queues[p] = new PiwikQueue<Request> (PIWIK_QUEUE_CAPACITY);
+		Weights[p] = (p ? Weights[p - 1] * PIWIK_PRIORITY_WEIGHT : 1);
+	}
+
 	Method = PIWIK_BASIC_METHOD; 
+	Compression = PIWIK_COMPRESSION_NONE;
+	CompressionLevel = PIWIK_COMPRESSION_LEVEL;
+	CompressionThreshold = PIWIK_COMPRESSION_THRESHOLD;
 	ConnectionTimeout = PIWIK_CONNECTION_TIMEOUT; 
 	DispatchInterval = PIWIK_DISPATCH_INTERVAL; 
-	Secure = DryRun = Synchronous = Running = false; 
-	SerialNumber = LastAcknowledged = 0;
+	BundleLimit = PIWIK_POST_BUNDLE;
+	BundleSize = PIWIK_BUNDLE_SIZE;
+	BatchAge = PIWIK_DISPATCH_INTERVAL * 1000;
+	Adaptive = false;
+	RoundTrip = 0;
+	Concurrency = PIWIK_CONCURRENCY;
+	IdleTimeout = PIWIK_CONNECTION_IDLE_TIMEOUT;
+	RetryLimit = PIWIK_RETRY_LIMIT;
+	RetryDelay = PIWIK_RETRY_DELAY;
+	RetryMaxDelay = PIWIK_RETRY_MAX_DELAY;
+	RateLimit = PIWIK_RATE_LIMIT;
+	ByteRateLimit = PIWIK_BYTE_RATE_LIMIT;
+	BreakerThreshold = PIWIK_BREAKER_THRESHOLD;
+	BreakerCooldown = PIWIK_BREAKER_COOLDOWN;
+	BreakerMaxCooldown = PIWIK_BREAKER_MAX_COOLDOWN;
+	QueueLimit = Queues[0]->Capacity ();
+	QueueSize = PIWIK_QUEUE_SIZE;
+	QueueWait = PIWIK_QUEUE_WAIT;
+	Overflow = PIWIK_OVERFLOW_DROP_PRIORITY;
+	Secure = Async = DryRun = Synchronous = Running = Stopped = Draining = false; 
+	Deadline = 0;
+	SerialNumber = Flushing = Waiters = Watchers = BatchCount = 0;
+	for (int i = 0; i < PIWIK_OPENING_SLOTS; i++)
+		Openings[i] = 0;
+	BatchBytes = 0;
+	BatchStart = 0;
+	PendingCount = PendingBytes = PeakCount = PeakBytes = DroppedCount = DroppedBytes = BlockedCount = 0;
+	SentCount = FailedCount = FlyingCount = 0;
+	Ring = 0;
+	::InitializeConditionVariable (&Room);
+	::InitializeConditionVariable (&Resolved);
 	Service = Wake = 0;
+	ServiceId = 0;
 }
 
 PiwikDispatcher::~PiwikDispatcher ()
 {
-	ShutdownService ();
+	Shutdown (PIWIK_SHUTDOWN_WAIT * 1000);
+
+	DeleteRetiredRings (true);
+	delete Ring;
+	for (int p = 0; p < PIWIK_PRIORITY_LEVELS; ++p)
+		delete Queues[p];
 }
 
 TSTRING PiwikDispatcher::CurrentApiUrl ()  
 { 
-	PiwikScopedLock lck (Mutex);
+	PiwikSharedLock lck (Mutex);
 	
 	return ApiUrl; 
 }
 
 bool PiwikDispatcher::SetApiUrl (LPCTSTR p)      
 { 
+	return SetApiUrls (&p, 1);
+}
+
+// Requests are spread over the given endpoints by visitor, through a consistent hash of the visitor ID.
+// The new set takes effect at once for all tracking calls, while requests already queued keep the endpoint they were routed to.
+// All endpoints share the connection security, which is taken from the last URL specifying a scheme.
+// The same set of endpoints keeps its ring; a ring replaced is retired, to be deleted by the service once no 
+// tracking call can be routing through it any more. Endpoints stay interned, since requests and statistics refer to them.
+
+bool PiwikDispatcher::SetApiUrls (LPCTSTR* urls, int cnt)
+{
 	PiwikScopedLock lck (Mutex);
-	
-	TSTRING url = p; 
+	std::vector<int> ids;
+	PiwikShardRing* rng;
+	TSTRING api, first;
+	bool sec = Secure;
+	int id;
+
+	for (int i = 0; i < cnt; ++i)
+	{
+		if (! ParseUrl (urls[i], api, sec))
+			return false;
+
+		int j = api.find ('/');
+		wstring host = WIDE_STRING (api.substr (0, j));
+		wstring path = WIDE_STRING (api.substr (j));
+		if ((id = Endpoints.Intern (host, path)) < 0)
+		{
+			Logger.Error (L"Too many API URLs, keeping the current ones");
+			return false;
+		}
+
+		ids.push_back (id);
+		if (i == 0)
+			first = api;
+		Logger.Info ((L"Changed API URL to host: " + host + L" path: " + path).c_str ());
+	}
+
+	if (ids.empty ())
+		return false;
+
+	ApiUrl = first;
+	Secure = sec;
+	if (Ring && Ring->Serves (ids))
+		return true;
+
+	rng = (PiwikShardRing*) ::InterlockedExchangePointer ((PVOID volatile*) &Ring, new PiwikShardRing (Endpoints, ids));
+	if (rng)
+		Retired.push_back (make_pair (::GetTickCount (), rng));
+
+	return true;
+}
+
+// Deletes the rings replaced long enough ago, or all of them once no tracking call can be made any more
+
+void PiwikDispatcher::DeleteRetiredRings (bool all)
+{
+	PiwikScopedLock lck (Mutex);
+	DWORD t = ::GetTickCount ();
+	size_t i, k;
+
+	for (i = k = 0; i < Retired.size (); ++i)
+		if (all || t - Retired[i].first >= PIWIK_RING_GRACE)
+			delete Retired[i].second;
+		else
+			Retired[k++] = Retired[i];
+	Retired.resize (k);
+}
+
+// Strips the scheme off the URL, setting the secure flag accordingly, and completes the path of the tracking API if missing
+
+bool PiwikDispatcher::ParseUrl (LPCTSTR p, TSTRING& api, bool& sec)
+{
+	TSTRING url = p;
+
 	if (url.compare (0, 7, _T("http://")) == 0)
-		url = url.substr (7), Secure = false;
+		url = url.substr (7), sec = false;
 	else if (url.compare (0, 8, _T("https://")) == 0)
-		url = url.substr (8), Secure = true;
+		url = url.substr (8), sec = true;
 	else if (url.find (_T("://")) != TSTRING::npos)
 		return false;
 
 	if (url.find (_T("piwik.php")) != TSTRING::npos || url.find (_T("piwik-proxy.php")) != TSTRING::npos)
-		ApiUrl = url;
+		api = url;
 	else
-		ComposeUrl (url, (ApiUrl = _T("piwik.php")));
-
-	int j = ApiUrl.find ('/');
-	ApiHost = WIDE_STRING (ApiUrl.substr (0, j));
-	ApiPath = WIDE_STRING (ApiUrl.substr (j));
-
-	Logger.Info ((L"Changed API URL to host: " + ApiHost + L" path: " + ApiPath).c_str ());
+		ComposeUrl (url, (api = _T("piwik.php")));
 
 	return true;
 }
@@ -87,18 +202,203 @@ void PiwikDispatcher::SetSecureConnection (bool f)
 	Secure = f;
 }
 
+void PiwikDispatcher::SetCompression (PiwikCompression c, int lvl, int thr)
+{
+	Compression = c;
+	CompressionLevel = lvl;
+	CompressionThreshold = thr;
+}
+
 void PiwikDispatcher::SetConnectionTimeout (int t)
 {
+	PiwikSharedLock lck (Mutex);
+
 	ConnectionTimeout = t;
+	ApplyTimeouts ();
+}
+
+void PiwikDispatcher::SetConnectionIdleTimeout (int t)
+{
+	PiwikSharedLock lck (Mutex);
+
+	IdleTimeout = t;
+	for (size_t i = 0; i < Lanes.size (); ++i)
+		Lanes[i]->Transport->SetIdleTimeout (t);
+}
+
+// The number of lanes is fixed when the service is launched, so this has to be called before tracking starts
+
+bool PiwikDispatcher::SetConcurrency (int n)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (Service)
+		return false;
+	Concurrency = max (1, n);
+
+	return true;
+}
+
+// The transport is chosen when the service is launched, so this has to be called before tracking starts
+
+bool PiwikDispatcher::SetAsyncTransport (bool v)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (Service)
+		return false;
+	Async = v;
+
+	return true;
+}
+
+// Every lane gets its own clone of the given transport when the service is launched, so this has to be called 
+// before tracking starts. The transport itself stays with the caller and has to outlive the dispatcher;
+// zero goes back to WinHTTP. Custom transports are blocking, so they replace the asynchronous transport too.
+
+bool PiwikDispatcher::SetTransport (PiwikTransport* t)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (Service)
+		return false;
+	Transport = t;
+
+	return true;
 }
 
 void PiwikDispatcher::SetDispatchInterval (int t)
 {
 	DispatchInterval = t;
+	if (t > 0)
+		BatchAge = t * 1000;
 	Synchronous = (t == 0);
 	Logger.Info ((Synchronous ? L"Entering synchronous mode" : L"Changed dispatch interval"), 0, t);
 }
 
+// A batch is sent as soon as it holds cnt requests or size bytes, or its oldest request has waited age msec.
+// Bundles are limited to the same number of requests and bytes. When adapting, a batch is held back no longer 
+// than about two round trips to the server, so that quiet periods get low latency while bursts still fill bundles.
+
+void PiwikDispatcher::SetBatching (int cnt, int size, int age, bool adp)
+{
+	BundleLimit = max (1, cnt);
+	BundleSize = max (1, size);
+	BatchAge = max (0, age);
+	Adaptive = adp;
+}
+
+void PiwikDispatcher::SetRetryPolicy (int lmt, int dly, int max)
+{
+	RetryLimit = lmt;
+	RetryDelay = dly;
+	RetryMaxDelay = max;
+}
+
+// Every endpoint is sent at most rps exchanges and bps bytes per second (0 for no limit). Exchanges over the limits
+// are held back, so that the requests they carry are sent later together with the ones tracked meanwhile.
+
+void PiwikDispatcher::SetRateLimits (int rps, int bps)
+{
+	RateLimit = max (0, rps);
+	ByteRateLimit = max (0, bps);
+}
+
+// An endpoint is given up for dly sec after lmt consecutive exchanges failed without response (0 to never give up),
+// and then probed with a single request, waiting twice as long after every failed probe up to max sec
+
+void PiwikDispatcher::SetCircuitBreaker (int lmt, int dly, int cap)
+{
+	BreakerThreshold = max (0, lmt);
+	BreakerCooldown = max (1, dly);
+	BreakerMaxCooldown = max (BreakerCooldown, cap);
+}
+
+// The number of pending requests can't exceed the capacity of the queue
+
+void PiwikDispatcher::SetQueueLimits (int cnt, int size, PiwikOverflowPolicy plc, int wait)
+{
+	QueueLimit = max (1, min (cnt, Queues[0]->Capacity ()));
+	QueueSize = max (1, size);
+	Overflow = plc;
+	QueueWait = wait;
+}
+
+// Bundles are filled from the priority classes in proportion to their weights, the most important class first
+
+bool PiwikDispatcher::SetPriorityWeight (PiwikPriority p, int w)
+{
+	if (p < 0 || p >= PIWIK_PRIORITY_LEVELS || w < 1)
+		return false;
+
+	Weights[p] = w;
+
+	return true;
+}
+
+// Identical events are gathered for wnd msec before being tracked as one, if wnd is positive.
+// Their number is reported in the custom dimension dim and their values are summed; without a dimension
+// the server would see a single event, so aggregation is refused.
+
+bool PiwikDispatcher::SetAggregation (int wnd, int dim, int keys)
+{
+	PiwikScopedLock lck (Gather);
+
+	if (wnd > 0 && dim <= 0)
+		return false;
+
+	if (! Stopped)
+		Rollups.Configure ((DWORD) max (0, wnd), (keys ? keys : PIWIK_AGGREGATE_DEFAULT), max (0, dim));
+	if (Wake)
+		::SetEvent (Wake);
+
+	return true;
+}
+
+// Requests left in the journal by a previous run are queued again right away, keeping their records
+
+bool PiwikDispatcher::SetJournal (LPCTSTR path, int size)
+{
+	std::vector<PiwikJournalEntry> pnd;
+	Request itm;
+
+	if (! Journal.Open (path, size, pnd))
+	{
+		Logger.Error (L"Could not open request journal", 0, GetLastError ());
+		return false;
+	}
+
+	Logger.Info (L"Replaying journaled requests", 0, (int) pnd.size ());
+
+	for (size_t i = 0; i < pnd.size (); ++i)
+	{
+		itm.Method = pnd[i].Method;
+		itm.Endpoint = max (0, Endpoints.Intern (pnd[i].Host, pnd[i].Path));
+		itm.Query.swap (pnd[i].Query);
+		itm.Record = pnd[i].Id;
+		itm.Affinity = RecoverAffinity (itm.Query);
+		Enqueue (itm);
+	}
+
+	return true;
+}
+
+// The affinity of a replayed request is hashed again from the visitor ID in its query,
+// so that replayed requests are spread over the lanes like the ones tracked by their visitor
+
+DWORD PiwikDispatcher::RecoverAffinity (const string& qry)
+{
+	size_t pos = qry.find ("&" PARAM_VISITOR_ID "=");
+	TSTRING id;
+
+	if (pos == string::npos)
+		return 0;
+	for (pos += strlen ("&" PARAM_VISITOR_ID "="); pos < qry.size () && isxdigit ((unsigned char) qry[pos]); pos++)
+		id += (TCHAR) qry[pos];
+
+	return ComputeHash (id.data (), id.size () * sizeof (TCHAR));
+}
+
 bool PiwikDispatcher::IsDryRun ()                     
 { 
 	return DryRun; 
@@ -116,231 +416,2161 @@ void PiwikDispatcher::SetLogger (wostream* s, PiwikLogLevel lvl)
 	Logger.SetLevel (lvl);
 }
 
-// Dispatching
-
-int PiwikDispatcher::Submit (PiwikState& st)
+void PiwikDispatcher::CollectLockStatistics (PiwikLockStatistics& sts)
 {
-	PiwikScopedLock lck (Mutex);
-	Request itm;
+	Mutex.CollectStatistics (sts);
+	Budget.CollectStatistics (sts);
+	Watch.CollectStatistics (sts);
+	Logger.CollectLockStatistics (sts);
 
-	itm.Serial = ++SerialNumber;
-	itm.Host   = ApiHost;
-	itm.Path   = ApiPath;
-	itm.Method = Method;
-	itm.Query  = st.Serialize ((Method == PIWIK_METHOD_GET ? PIWIK_FORMAT_URL : PIWIK_FORMAT_JSON));
+	PiwikSharedLock lck (Mutex);
+	for (size_t i = 0; i < Lanes.size (); ++i)
+		Lanes[i]->Mutex.CollectStatistics (sts);
+}
 
-	Requests.push_back (itm);
+void PiwikDispatcher::ResetLockStatistics ()
+{
+	Mutex.ResetStatistics ();
+	Budget.ResetStatistics ();
+	Watch.ResetStatistics ();
+	Logger.ResetLockStatistics ();
 
-	if (! Service)
-		LaunchService ();
+	PiwikSharedLock lck (Mutex);
+	for (size_t i = 0; i < Lanes.size (); ++i)
+		Lanes[i]->Mutex.ResetStatistics ();
+}
 
-	if (Synchronous)
-		Flush ();
+PiwikConnectionStatistics PiwikDispatcher::CurrentConnectionStatistics ()
+{
+	PiwikSharedLock lck (Mutex);
+	PiwikConnectionStatistics sts, itm;
 
-	Logger.Debug (L"Submitting query: ", itm.Query.c_str (), itm.Serial);
+	for (size_t i = 0; i < Lanes.size (); ++i)
+	{
+		itm = Lanes[i]->Transport->CurrentStatistics ();
+		sts.Opens += itm.Opens;
+		sts.Reuses += itm.Reuses;
+		sts.Evictions += itm.Evictions;
+	}
 
-	return itm.Serial; 
+	return sts;
 }
 
-bool PiwikDispatcher::Flush ()
+PiwikCompressionStatistics PiwikDispatcher::CurrentCompressionStatistics ()
 {
-	return (Service && ::SetEvent (Wake));
+	PiwikSharedLock lck (Mutex);
+	PiwikCompressionStatistics sts, itm;
+
+	for (size_t i = 0; i < Lanes.size (); ++i)
+	{
+		itm = Lanes[i]->Compressor.CurrentStatistics ();
+		sts.Batches += itm.Batches;
+		sts.BytesIn += itm.BytesIn;
+		sts.BytesOut += itm.BytesOut;
+		sts.Time += itm.Time;
+	}
+
+	return sts;
 }
 
-int PiwikDispatcher::RequestStatus (int rqst)
+// Lists every endpoint set during the run; the empty one only if requests were tracked before any API URL was set
+
+std::vector<PiwikEndpointStatistics> PiwikDispatcher::CurrentEndpointStatistics ()
 {
-	PiwikScopedLock lck (Mutex);
+	std::vector<PiwikEndpointStatistics> lst;
+	PiwikEndpointStatistics sts;
 
-	for (size_t i = 0; i < Failures.size (); ++i)
-		if (Failures[i] == rqst)
-			return -1;
+	for (int i = 0; i < Endpoints.Size (); ++i)
+	{
+		PiwikEndpoint& ep = Endpoints.Lookup (i);
+		if (i == 0 && ! ep.Routed)
+			continue;
+		sts.Host = ep.Host;
+		sts.Path = ep.Path;
+		sts.Routed = ::InterlockedCompareExchange (&ep.Routed, 0, 0);
+		sts.Sent = ::InterlockedCompareExchange (&ep.Sent, 0, 0);
+		sts.Failed = ::InterlockedCompareExchange (&ep.Failed, 0, 0);
+		sts.Dropped = ::InterlockedCompareExchange (&ep.Dropped, 0, 0);
+		sts.Exchanges = ::InterlockedCompareExchange (&ep.Exchanges, 0, 0);
+		sts.Bytes = ::InterlockedCompareExchange64 (&ep.Bytes, 0, 0);
+		sts.Throttled = ::InterlockedCompareExchange (&ep.Throttled, 0, 0);
+		sts.Slowdown = ep.Limiter.CurrentSlowdown ();
+		ep.Breaker.CollectStatistics (sts);
+		lst.push_back (sts);
+	}
 
-	if (LastAcknowledged >= rqst)
-		return 1;
+	return lst;
+}
 
-	return 0;
+PiwikQueueStatistics PiwikDispatcher::CurrentQueueStatistics ()
+{
+	PiwikQueueStatistics sts;
+
+	sts.Pending = (int) ::InterlockedCompareExchange64 (&PendingCount, 0, 0);
+	sts.PendingBytes = ::InterlockedCompareExchange64 (&PendingBytes, 0, 0);
+	sts.PeakPending = (int) ::InterlockedCompareExchange64 (&PeakCount, 0, 0);
+	sts.PeakBytes = ::InterlockedCompareExchange64 (&PeakBytes, 0, 0);
+	sts.Dropped = (int) ::InterlockedCompareExchange64 (&DroppedCount, 0, 0);
+	sts.DroppedBytes = ::InterlockedCompareExchange64 (&DroppedBytes, 0, 0);
+	sts.Blocked = (int) ::InterlockedCompareExchange64 (&BlockedCount, 0, 0);
+
+	return sts;
 }
 
-// Internals
+// Histograms are recorded without any lock, and a snapshot taking them with a reset loses none of the values
 
-// This function will launch the dispatching thread and create all its required resources
+PiwikLatencyStatistics PiwikDispatcher::CurrentLatencyStatistics (bool rst)
+{
+	PiwikLatencyStatistics sts;
 
-bool PiwikDispatcher::LaunchService ()
+	DelayHistogram.Collect (sts.QueueDelay, rst);
+	RoundTripHistogram.Collect (sts.RoundTrip, rst);
+	CountHistogram.Collect (sts.BundleCount, rst);
+	SizeHistogram.Collect (sts.BundleBytes, rst);
+	SerializeHistogram.Collect (sts.Serialization, rst);
+
+	return sts;
+}
+
+// The counters are read one after the other without stopping the pipeline, so the snapshot is consistent only as far as
+// each counter goes; times are kept in ticks of the performance counter and converted here
+
+PiwikStatistics PiwikDispatcher::CurrentStatistics ()
 {
-	Logger.Info (L"Starting Piwik dispatch service");
+	PiwikStatistics sts;
+	PiwikConnectionStatistics cnn = CurrentConnectionStatistics ();
 
-	Running = true;
-	if ((Session = ::WinHttpOpen (L"Piwik Desktop Client", WINHTTP_ACCESS_TYPE_NO_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0)))
-		if ((Wake = ::CreateEvent (0, FALSE, FALSE, 0)))
-			if ((Service = (HANDLE) _beginthreadex (0, 0, ServiceRoutine, this, 0, 0)))
-				return true;
+	sts.Tracked = Counters.Sum (PIWIK_COUNT_TRACKED);
+	sts.Disabled = Counters.Sum (PIWIK_COUNT_DISABLED);
+	sts.Queued = Counters.Sum (PIWIK_COUNT_QUEUED);
+	sts.Pending = (int) ::InterlockedCompareExchange64 (&PendingCount, 0, 0);
+	sts.PendingBytes = ::InterlockedCompareExchange64 (&PendingBytes, 0, 0);
+	sts.Bundles = Counters.Sum (PIWIK_COUNT_BUNDLES);
+	sts.WireBytes = Counters.Sum (PIWIK_COUNT_WIRE_BYTES);
+	sts.Acknowledged = ::InterlockedCompareExchange64 (&SentCount, 0, 0);
+	sts.Failed = ::InterlockedCompareExchange64 (&FailedCount, 0, 0);
+	sts.Retried = Counters.Sum (PIWIK_COUNT_RETRIED);
+	sts.Dropped = ::InterlockedCompareExchange64 (&DroppedCount, 0, 0);
+	sts.Opens = cnn.Opens;
+	sts.Reuses = cnn.Reuses;
+	sts.TrackTime = ElapsedMicroseconds (0, Counters.Sum (PIWIK_COUNT_TRACK_TIME));
+	sts.SerializeTime = ElapsedMicroseconds (0, Counters.Sum (PIWIK_COUNT_SERIALIZE_TIME));
+	sts.SendTime = ElapsedMicroseconds (0, Counters.Sum (PIWIK_COUNT_SEND_TIME));
 
-	Logger.Error (L"Could not launch Piwik dispatch service");
-	return false;
+	return sts;
 }
 
-// This function will stop the dispatching thread and delete all associated resources
+// Dispatching
+
+// Events that can be aggregated are only counted into their rollup, which shares its identifier with all of them;
+// a tracking call asking for a completion routine always gets a request of its own.
 
-void PiwikDispatcher::ShutdownService ()
+int PiwikDispatcher::Submit (PiwikState& st, PiwikCompletion fnc, void* ctx)
 {
-	//the following code causing a crash TBD
-	//Logger.Info (L"Terminating Piwik dispatch service");
+	int srl;
 
-	Running = false;
-	Flush ();
-	Sleep (250); // seems to be required if service has been recently launched
-	if (Service && ::WaitForSingleObject (Service, PIWIK_SHUTDOWN_WAIT * 1000) != WAIT_OBJECT_0)
-		::TerminateThread (Service, -1);
-	if (Service)
-		CloseHandle (Service), Service = 0;
-	if (Wake)
-		CloseHandle (Wake), Wake = 0;
-	if (Session)
-		WinHttpCloseHandle (Session), Session = 0;
+	if (! fnc && Rollups.IsActive () && (srl = Aggregate (st)))
+		return srl;
+
+	return Admit (st, fnc, ctx);
 }
 
-// Main dispatching routine run in the service thread
+// Counts an event into the rollup of its kind, opening one if there is none yet. Returns the identifier of the rollup,
+// or 0 if the event does not qualify. The service is woken up for a new rollup, so that it can time the window.
 
-unsigned __stdcall PiwikDispatcher::ServiceRoutine (void* arg)
+int PiwikDispatcher::Aggregate (PiwikState& st)
 {
-	PiwikDispatcher* dsp = (PiwikDispatcher*) arg;
-	Request itm;
-	string msg;
-	int grp[PIWIK_POST_BUNDLE];
-	int cnt, avl;
-	bool vld;
+	PiwikScopedLock lck (Gather);
+	int srl;
 
-	while (dsp && dsp->Running)
+	if (! Rollups.IsActive () || ! Rollups.Accepts (st))
+		return 0;
+	if ((srl = Rollups.Merge (st)))
+		return srl;
+
+	if (! Service && ! Stopped)
 	{
-		::WaitForSingleObject (dsp->Wake, (dsp->DispatchInterval > 0 ? dsp->DispatchInterval * 1000 - 500 : INFINITE));
-		cnt = 0, msg.clear ();
-		while (dsp->Requests.size ())
-		{
-			dsp->Mutex.Activate ();
-			itm = dsp->Requests.front ();
-			dsp->Requests.pop_front ();
-			avl = dsp->Requests.size ();
-			dsp->Mutex.Release ();
+		PiwikScopedLock lck (Mutex);
+		if (! Service && ! Stopped)
+			LaunchService ();
+	}
 
-			grp[cnt++] = itm.Serial;
+	srl = ::InterlockedIncrement (&SerialNumber);
+	Outcomes.Open (srl);
+	Rollups.Open (st, srl, ::GetTickCount ());
+	if (Wake)
+		::SetEvent (Wake);
 
-			if (itm.Method == PIWIK_METHOD_GET)
-				vld = dsp->SendRequest (itm.Host, itm.Path, PIWIK_METHOD_GET, itm.Query);
-			else
-			{
-                msg += (msg.empty () ? "{" QUOTES "requests" QUOTES ":[\"" : ",\"") + itm.Query + QUOTES;
-				if (cnt < PIWIK_POST_BUNDLE && avl)
-					continue;
-				vld = dsp->SendRequest (itm.Host, itm.Path, PIWIK_METHOD_POST, msg + "]}");
-			}
+	return srl;
+}
 
-			if (vld)
-				dsp->LastAcknowledged = itm.Serial;
-			else
-			{
-				dsp->Mutex.Activate ();
-				for (int i = 0; i < cnt; ++i)
-					dsp->Failures.push_back (grp[i]);
-				dsp->Mutex.Release ();
-			}
+// Turns the rollups whose window has closed, or all of them, into requests. Once closed, no more events are aggregated.
 
-			cnt = 0, msg.clear ();
-		}
-	}
+void PiwikDispatcher::ReleaseRollups (bool all, bool cls)
+{
+	std::vector<pair<int, PiwikState> > due;
 
-	_endthreadex (0);
-	return 0;
+	Gather.Activate ();
+	Rollups.Take (due, ::GetTickCount (), all);
+	if (cls)
+		Rollups.Configure (0, PIWIK_AGGREGATE_DEFAULT, 0);
+	Gather.Release ();
+
+	for (size_t i = 0; i < due.size (); ++i)
+		Admit (due[i].second, 0, 0, due[i].first);
 }
 
-bool PiwikDispatcher::SendRequest (wstring& host, wstring& path, PiwikMethod mth, string& qry)
+// Serialization happens before anything is shared, and the finished request is handed over to the lock-free queue.
+// Apart from the journal's own, no lock is taken: the endpoint comes from the current ring, which is replaced as a whole but never changed,
+// so tracking threads don't contend with each other or the service.
+// If a journal is open the request is also recorded there, which costs a copy into its mapped memory but no disk access.
+// The completion routine, if given, is called with ctx once the request is settled. Rollups come with their identifier.
+
+int PiwikDispatcher::Admit (PiwikState& st, PiwikCompletion fnc, void* ctx, int srl)
 {
-	HINTERNET Connection = 0, Request = 0;
-	wchar_t* verb;
-	void* data;
-	DWORD size;
-	DWORD code = 0;
-	DWORD opts;
-	int rsl;
-	bool vld;
+	Request itm;
+	PiwikMethod mth = Method;
+	LONGLONG t0, t1;
 
-	if (DryRun)
+	itm.Serial = srl;
+	itm.Notify = fnc;
+	itm.Context = ctx;
+	t0 = ReadClock ();
+	itm.Query  = st.Serialize ((mth == PIWIK_METHOD_GET ? PIWIK_FORMAT_URL : PIWIK_FORMAT_JSON));
+	t1 = ReadClock ();
+	Counters.Add (PIWIK_COUNT_SERIALIZE_TIME, t1 - t0);
+	itm.Serializing = (int) ElapsedMicroseconds (t0, t1);
+	itm.Method = mth;
+	itm.Affinity = ComputeHash (st.VisitorId.data (), st.VisitorId.size () * sizeof (TCHAR));
+
+	// unless given, the priority follows the value of what is tracked: goals, interactions, events, and views last.
+	// A session start goes into the highest class, and it is counted for its visitor until it is settled: 
+	// the service holds back the later requests of the visit meanwhile (see HoldBack).
+	if (st.NewSession)
 	{
-		Logger.Log (L"DRYRUN - Not sending request: ", qry.c_str ());
-		return true;
+		itm.Priority = PIWIK_PRIORITY_HIGH;
+		itm.Opening = true;
+		::InterlockedIncrement (&Openings[itm.Affinity % PIWIK_OPENING_SLOTS]);
 	}
+	else if (st.Priority > PIWIK_PRIORITY_AUTO && st.Priority < PIWIK_PRIORITY_LEVELS)
+		itm.Priority = st.Priority;
+	else if (st.Goal || st.Revenue)
+		itm.Priority = PIWIK_PRIORITY_HIGH;
+	else if (! st.ContentInteraction.empty () || ! st.OutLink.empty ())
+		itm.Priority = PIWIK_PRIORITY_ELEVATED;
+	else if (! st.EventCategory.empty ())
+		itm.Priority = PIWIK_PRIORITY_NORMAL;
+	else
+		itm.Priority = PIWIK_PRIORITY_LOW;
 
-	if (mth == PIWIK_METHOD_GET)
+	PiwikShardRing* rng = Ring;
+	itm.Endpoint = (rng ? rng->Route (itm.Affinity) : 0);
+	::InterlockedIncrement (&Endpoints.Lookup (itm.Endpoint).Routed);
+
+	if (Journal.IsOpen ())
 	{
-		verb = L"GET";
-		path += ToWide (qry);
-		data = 0, size = 0;
+		PiwikJournalEntry ent;
+		ent.Method = itm.Method;
+		ent.Host = Endpoints.Lookup (itm.Endpoint).Host;
+		ent.Path = Endpoints.Lookup (itm.Endpoint).Path;
+		ent.Query.swap (itm.Query);
+		if (! (itm.Record = Journal.Append (ent)))
+			Logger.Error (L"Request journal is full");
+		itm.Query.swap (ent.Query);
 	}
-	else
+
+	return Enqueue (itm);
+}
+
+// Numbers the request and puts it into the queue, if the budget of pending requests allows.
+// Otherwise the overflow policy decides: the new request is either dropped right away, or accepted while the service
+// is woken up to drop older or less important ones, or the caller waits for room for a limited time.
+// Rollups are numbered already, and since the service releases them it never waits for room for them.
+
+int PiwikDispatcher::Enqueue (Request& itm)
+{
+	LONGLONG size = (LONGLONG) itm.Query.size ();
+	LONGLONG byt;
+	bool blk = (itm.Serial == 0);
+	int srl, n;
+
+	if (! Service && ! Stopped)
 	{
-		verb = L"POST";
-		data = (void*) qry.data (), size = qry.size ();
+		PiwikScopedLock lck (Mutex);
+		if (! Service && ! Stopped)
+			LaunchService ();
 	}
 
-	Connection = ::WinHttpConnect (Session, host.c_str (), INTERNET_DEFAULT_PORT, 0); 
-	if (! Connection)
+	if (blk)
 	{
-		Logger.Error (L"Could not open HTTP connection", 0, GetLastError ());
-		return false;
+		itm.Serial = srl = ::InterlockedIncrement (&SerialNumber);
+		Outcomes.Open (srl);
 	}
+	else
+		srl = itm.Serial;
 
-	Request = ::WinHttpOpenRequest (Connection, verb, path.c_str (), 0, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES, 
-									WINHTTP_FLAG_ESCAPE_DISABLE_QUERY | WINHTTP_FLAG_REFRESH | (Secure ? WINHTTP_FLAG_SECURE : 0));
-	if (! Request)
+	Logger.Debug (L"Submitting query: ", itm.Query.c_str (), srl);
+
+	if (Stopped)
 	{
-		Logger.Error (L"Could not create HTTP request", 0, GetLastError ());
-		::WinHttpCloseHandle (Connection);
-		return false;
+		Logger.Error (L"Dispatch service shut down, dropping request", 0, srl);
+		Settle (itm, PIWIK_STATUS_DROPPED, false);
+		return srl;
 	}
-	
-	opts = SECURITY_FLAG_IGNORE_CERT_CN_INVALID | SECURITY_FLAG_IGNORE_CERT_DATE_INVALID | SECURITY_FLAG_IGNORE_UNKNOWN_CA | SECURITY_FLAG_IGNORE_CERT_WRONG_USAGE;
-	::WinHttpSetOption (Request, WINHTTP_OPTION_SECURITY_FLAGS, &opts, sizeof opts);
 
-	rsl = ::WinHttpSendRequest (Request, L"Content-Type:application/json;charset=UTF-8\r\n", -1, data, size, size, 0);
-	if (! rsl)
+	if (! Reserve (size) && ! (blk && Overflow == PIWIK_OVERFLOW_BLOCK && AwaitRoom (size)))
 	{
-		Logger.Error (L"Could not send HTTP request", 0, GetLastError ());
-		::WinHttpCloseHandle (Request);
-		::WinHttpCloseHandle (Connection);
-		return false;
+		Logger.Error (L"Request queue is full, dropping request", 0, srl);
+		Settle (itm, PIWIK_STATUS_DROPPED, false);
+		return srl;
 	}
 
-	rsl = ::WinHttpReceiveResponse (Request, 0) && 
-		  ::WinHttpQueryHeaders (Request, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, 
-				                          WINHTTP_HEADER_NAME_BY_INDEX, &code, &(size = sizeof code), WINHTTP_NO_HEADER_INDEX);
-	if (rsl && code / 100 == 2)
+	itm.Queued = ReadClock ();
+
+	// the batch is counted before the push, so that the service never takes more from it than was counted
+	if ((n = ::InterlockedIncrement (&BatchCount)) == 1)
+		BatchStart = ::GetTickCount ();
+	byt = ::InterlockedExchangeAdd64 (&BatchBytes, size) + size;
+
+	// the service can't wait for room it has to make itself, so its own requests (rollups) go to the backlog directly
+	if (::GetCurrentThreadId () == ServiceId)
 	{
-		#ifdef PIWIK_SERVER_IS_IN_DEBUG_MODE
-			ReadResponse (Request);
-		#endif
-		Logger.Debug (L"Sent HTTP request: ", qry.c_str ());
-		vld = true;
+		Backlogs[itm.Priority].push_back (Request ());
+		swap (Backlogs[itm.Priority].back (), itm);
 	}
-	else
+	else if (! Push (itm))
 	{
-		Logger.Error (L"Unexpected HTTP response", 0, code);
-		vld = false;
+		::InterlockedDecrement (&BatchCount);
+		::InterlockedExchangeAdd64 (&BatchBytes, -size);
+		Logger.Error (L"Request queue ring is full, dropping request", 0, srl);
+		Settle (itm, PIWIK_STATUS_DROPPED);
+		return srl;
 	}
+	Counters.Add (PIWIK_COUNT_QUEUED, 1);
 
-	::WinHttpCloseHandle (Request);
-	::WinHttpCloseHandle (Connection);
-	
-	return vld;
+	// the service is woken up when the batch starts, so that it can time it, and when it fills up
+	if (Synchronous)
+		Flush ();
+	else if (n == 1 || n == BundleLimit || (byt >= BundleSize && byt - size < BundleSize))
+		::SetEvent (Wake);
+
+	return srl; 
+}
+
+bool PiwikDispatcher::Flush ()
+{
+	::InterlockedExchange (&Flushing, 1);
+	return (Service && ::SetEvent (Wake));
+}
+
+// Status lookups take constant time and no lock, however long the dispatcher has been running
+
+int PiwikDispatcher::RequestStatus (int rqst)
+{
+	if (rqst <= 0 || rqst > SerialNumber)
+		return PIWIK_STATUS_UNKNOWN;
+
+	return Outcomes.Lookup (rqst);
 }
 
-void PiwikDispatcher::ReadResponse (HINTERNET rqst)
+// Waits until none of the given requests is pending any more, at most for tmo msec (or INFINITE).
+// Outcomes never go back to pending, so requests already found settled need not be looked at again.
+// Returns true if all of them have been settled (or are unknown).
+
+bool PiwikDispatcher::AwaitRequests (const int* rqst, int cnt, DWORD tmo)
 {
-	DWORD size = 0, wrt = 0;
-	if (::WinHttpQueryDataAvailable (rqst, &size) && size > 0)
+	DWORD end = ::GetTickCount () + tmo;
+	LONG rmn = 0;
+	int i = 0;
+
+	::InterlockedIncrement (&Watchers);
+
+	Watch.Activate ();
+	while (1)
 	{
-		LPSTR rsp = (LPSTR) malloc (size + 2); memset (rsp, 0, size + 2);
-		::WinHttpReadData (rqst, (void*) rsp, size, &wrt);
-		Logger.Log (L"Response: ", rsp);
-		free (rsp);
+		while (i < cnt && RequestStatus (rqst[i]) != PIWIK_STATUS_PENDING)
+			i++;
+		if (i == cnt || (tmo != INFINITE && (rmn = (LONG) (end - ::GetTickCount ())) <= 0))
+			break;
+		Watch.Await (Resolved, (tmo == INFINITE ? INFINITE : (DWORD) rmn));
 	}
+	Watch.Release ();
+
+	::InterlockedDecrement (&Watchers);
+
+	return (i == cnt);
 }
 
+// Internals
+
+// Takes a share of the budget for a new request. When dropping older requests to make room, the share is kept 
+// even if it exceeds the budget, and the service is woken up to bring the queue back within it.
+
+bool PiwikDispatcher::Reserve (LONGLONG size)
+{
+	LONGLONG cnt = ::InterlockedExchangeAdd64 (&PendingCount, 1) + 1;
+	LONGLONG byt = ::InterlockedExchangeAdd64 (&PendingBytes, size) + size;
+	LONGLONG old;
+
+	if (cnt > QueueLimit || byt > QueueSize)
+	{
+		if (Overflow != PIWIK_OVERFLOW_DROP_OLDEST && Overflow != PIWIK_OVERFLOW_DROP_PRIORITY)
+		{
+			::InterlockedExchangeAdd64 (&PendingCount, -1);
+			::InterlockedExchangeAdd64 (&PendingBytes, -size);
+			return false;
+		}
+		::SetEvent (Wake);
+	}
+
+	while ((old = PeakCount) < cnt && ::InterlockedCompareExchange64 (&PeakCount, cnt, old) != old)
+		;
+	while ((old = PeakBytes) < byt && ::InterlockedCompareExchange64 (&PeakBytes, byt, old) != old)
+		;
+
+	return true;
+}
+
+// Puts a request into the ring of its priority. A full ring (the service being held up in a send) means the request
+// is dropped, unless the overflow policy is to block: then the service is woken up and the caller waits for it to
+// make room, at most for the configured time. Nothing is waited for if the service is not running.
+
+bool PiwikDispatcher::Push (Request& itm)
+{
+	DWORD end = ::GetTickCount () + (DWORD) QueueWait;
+
+	while (! Queues[itm.Priority]->Push (itm))
+	{
+		if (! Service || Stopped || Overflow != PIWIK_OVERFLOW_BLOCK || (LONG) (end - ::GetTickCount ()) <= 0)
+			return false;
+		::SetEvent (Wake);
+		::Sleep (1);
+	}
+
+	return true;
+}
+
+// Flushes the queue and waits for the service to free enough of the budget, at most for the configured time
+
+bool PiwikDispatcher::AwaitRoom (LONGLONG size)
+{
+	DWORD end = ::GetTickCount () + (DWORD) QueueWait;
+	LONG rmn;
+	bool rsl;
+
+	::InterlockedExchangeAdd64 (&BlockedCount, 1);
+	::InterlockedIncrement (&Waiters);
+	Flush ();
+
+	Budget.Activate ();
+	while (! (rsl = Reserve (size)) && (rmn = (LONG) (end - ::GetTickCount ())) > 0)
+		Budget.Await (Room, (DWORD) rmn);
+	Budget.Release ();
+
+	::InterlockedDecrement (&Waiters);
+
+	return rsl;
+}
+
+bool PiwikDispatcher::OverBudget ()
+{
+	return (::InterlockedCompareExchange64 (&PendingCount, 0, 0) > QueueLimit || 
+			::InterlockedCompareExchange64 (&PendingBytes, 0, 0) > QueueSize);
+}
+
+// Brings the pending requests back within the budget, dropping the oldest ones first, or the least important ones.
+// Queued requests are moved into the backlogs so that all requests waiting in the service can be weighed together,
+// along with those waiting in the lanes, which are held back meanwhile.
+
+void PiwikDispatcher::Trim ()
+{
+	Request bfr[PIWIK_POST_BUNDLE];
+	std::vector<pair<LONGLONG, Request*> > cnd;
+	LONGLONG byt = 0;
+	size_t i, k;
+	int n, p;
+
+	if (! OverBudget ())
+		return;
+
+	for (k = 0; k < Lanes.size (); ++k)
+		Lanes[k]->Mutex.Activate ();
+
+	for (p = 0; p < PIWIK_PRIORITY_LEVELS; ++p)
+		while ((n = Queues[p]->Pop (bfr, PIWIK_POST_BUNDLE)) > 0)
+			for (k = 0; k < (size_t) n; k++)
+			{
+				Backlogs[p].push_back (Request ());
+				swap (Backlogs[p].back (), bfr[k]);
+			}
+
+	cnd.reserve (Retries.size () + (size_t) ::InterlockedCompareExchange64 (&PendingCount, 0, 0));
+	for (i = 0; i < Retries.size (); ++i)
+		cnd.push_back (make_pair ((LONGLONG) (Overflow == PIWIK_OVERFLOW_DROP_PRIORITY ? Retries[i].Priority : 0) << 32 | (DWORD) Retries[i].Serial, &Retries[i]));
+	for (p = 0; p < PIWIK_PRIORITY_LEVELS; ++p)
+		for (i = 0; i < Backlogs[p].size (); ++i)
+			cnd.push_back (make_pair ((LONGLONG) (Overflow == PIWIK_OVERFLOW_DROP_PRIORITY ? p : 0) << 32 | (DWORD) Backlogs[p][i].Serial, &Backlogs[p][i]));
+	for (k = 0; k < Lanes.size (); ++k)
+		for (i = 0; i < Lanes[k]->Inbox.size (); ++i)
+			cnd.push_back (make_pair ((LONGLONG) (Overflow == PIWIK_OVERFLOW_DROP_PRIORITY ? Lanes[k]->Inbox[i].Priority : 0) << 32 | (DWORD) Lanes[k]->Inbox[i].Serial, &Lanes[k]->Inbox[i]));
+	sort (cnd.begin (), cnd.end ());
+
+	for (i = 0; i < cnd.size () && OverBudget (); ++i)
+	{
+		Settle (*cnd[i].second, PIWIK_STATUS_DROPPED);
+		cnd[i].second->Serial = 0;
+	}
+
+	// dropped requests from the backlogs leave the current batch
+	for (n = 0, p = 0; p < PIWIK_PRIORITY_LEVELS; ++p)
+	{
+		for (k = 0; k < Backlogs[p].size (); ++k)
+			if (Request::IsSettled (Backlogs[p][k]))
+				n++, byt += Backlogs[p][k].Query.size ();
+		Backlogs[p].erase (remove_if (Backlogs[p].begin (), Backlogs[p].end (), Request::IsSettled), Backlogs[p].end ());
+	}
+	::InterlockedExchangeAdd (&BatchCount, -n);
+	::InterlockedExchangeAdd64 (&BatchBytes, -byt);
+
+	Retries.erase (remove_if (Retries.begin (), Retries.end (), Request::IsSettled), Retries.end ());
+	for (k = 0; k < Lanes.size (); ++k)
+	{
+		Lanes[k]->Inbox.erase (remove_if (Lanes[k]->Inbox.begin (), Lanes[k]->Inbox.end (), Request::IsSettled), Lanes[k]->Inbox.end ());
+		Lanes[k]->Mutex.Release ();
+	}
+
+	Logger.Error (L"Request queue over budget, requests dropped: ", 0, (int) i);
+}
+
+// Records the final outcome of a request and gives its share of the budget back (if it had one).
+// Threads waiting for outcomes are woken up, and the completion routine of the request is called right here,
+// on whatever thread settles it, so it has to return quickly and must not call back into the tracker.
+
+void PiwikDispatcher::Settle (Request& itm, PiwikRequestStatus sts, bool rsv)
+{
+	LONGLONG size = (LONGLONG) itm.Query.size ();
+	PiwikEndpoint& ep = Endpoints.Lookup (itm.Endpoint);
+
+	// the service may be holding back requests of the visit this one starts
+	if (itm.Opening && ::InterlockedDecrement (&Openings[itm.Affinity % PIWIK_OPENING_SLOTS]) == 0 && Wake)
+		::SetEvent (Wake);
+	itm.Opening = false;
+	Outcomes.Close (itm.Serial, sts);
+	if (itm.Record && sts != PIWIK_STATUS_PERSISTED)
+		Journal.Complete (itm.Record);
+	if (Watchers)
+		SignalResolved ();
+	if (itm.Notify)
+		itm.Notify (itm.Serial, sts, itm.Context);
+
+	if (rsv)
+	{
+		::InterlockedExchangeAdd64 (&PendingCount, -1);
+		::InterlockedExchangeAdd64 (&PendingBytes, -size);
+	}
+
+	if (sts == PIWIK_STATUS_DROPPED)
+	{
+		::InterlockedExchangeAdd64 (&DroppedCount, 1);
+		::InterlockedExchangeAdd64 (&DroppedBytes, size);
+		::InterlockedIncrement (&ep.Dropped);
+	}
+	else if (sts == PIWIK_STATUS_SENT)
+	{
+		::InterlockedExchangeAdd64 (&SentCount, 1);
+		::InterlockedIncrement (&ep.Sent);
+	}
+	else if (sts == PIWIK_STATUS_FAILED || sts == PIWIK_STATUS_REJECTED)
+	{
+		::InterlockedExchangeAdd64 (&FailedCount, 1);
+		::InterlockedIncrement (&ep.Failed);
+	}
+}
+
+// Wakes up the tracking threads waiting for room. Taking the lock first makes sure that none of them 
+// is between checking the budget and starting to wait, so no wakeup gets lost.
+
+void PiwikDispatcher::SignalRoom ()
+{
+	if (! Waiters)
+		return;
+
+	Budget.Activate ();
+	Budget.Release ();
+	::WakeAllConditionVariable (&Room);
+}
+
+// Wakes up the threads waiting for outcomes, in the same way as those waiting for room
+
+void PiwikDispatcher::SignalResolved ()
+{
+	Watch.Activate ();
+	Watch.Release ();
+	::WakeAllConditionVariable (&Resolved);
+}
+
+// This function will launch the dispatching thread and create all its required resources.
+// With the blocking transport, lanes get threads of their own only if more than one bundle may be in flight;
+// with the asynchronous one they only get an event telling when they are idle.
+
+bool PiwikDispatcher::LaunchService ()
+{
+	Lane* ln;
+	int i;
+
+	if (Transport)
+		Async = false;
+
+	Logger.Info ((Async ? L"Starting Piwik dispatch service, asynchronous lanes: " : L"Starting Piwik dispatch service, lanes: "), 0, Concurrency);
+
+	Running = true;
+	if ((Session = ::WinHttpOpen (L"Piwik Desktop Client", WINHTTP_ACCESS_TYPE_NO_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, (Async ? WINHTTP_FLAG_ASYNC : 0))) &&
+		(! Async || ::WinHttpSetStatusCallback (Session, AsyncCallback, WINHTTP_CALLBACK_FLAG_ALL_COMPLETIONS, 0) != WINHTTP_INVALID_STATUS_CALLBACK))
+		if ((Wake = ::CreateEvent (0, FALSE, FALSE, 0)))
+		{
+			for (i = 0; i < Concurrency; i++)
+			{
+				Lanes.push_back (ln = new Lane);
+				ln->Owner = this;
+				ln->Seed = ::GetTickCount () ^ (unsigned int) (DWORD_PTR) ln;
+				ln->Http.SetSession (Session);
+				if (Transport)
+					ln->Transport = Transport->Clone ();
+				ln->Transport->SetIdleTimeout (IdleTimeout);
+				if (Async ? ! (ln->Wake = ::CreateEvent (0, TRUE, TRUE, 0)) :
+					(Concurrency > 1 && ! ((ln->Wake = ::CreateEvent (0, FALSE, FALSE, 0)) && 
+										   (ln->Thread = (HANDLE) _beginthreadex (0, 0, LaneRoutine, ln, 0, 0)))))
+					break;
+			}
+
+			ApplyTimeouts ();
+
+			if (i == Concurrency && (Service = (HANDLE) _beginthreadex (0, 0, ServiceRoutine, this, 0, 0)))
+				return true;
+		}
+
+	Logger.Error (L"Could not launch Piwik dispatch service");
+	return false;
+}
+
+// Timeouts of the session apply to all requests opened afterwards; custom transports get them as well
+
+void PiwikDispatcher::ApplyTimeouts ()
+{
+	if (Session)
+		::WinHttpSetTimeouts (Session, ConnectionTimeout * 1000, ConnectionTimeout * 1000, PIWIK_RESPONSE_TIMEOUT * 1000, PIWIK_RESPONSE_TIMEOUT * 1000);
+	for (size_t i = 0; i < Lanes.size (); ++i)
+		Lanes[i]->Transport->SetTimeouts (ConnectionTimeout * 1000, PIWIK_RESPONSE_TIMEOUT * 1000);
+}
+
+// While draining, the timeouts of each exchange are cut down to the time left before the deadline,
+// so that no exchange started in time can keep the shutdown waiting for long
+
+void PiwikDispatcher::CapTimeouts (Lane& ln)
+{
+	int rmn = max (1, (int) (LONG) (Deadline - ::GetTickCount ()));
+
+	ln.Transport->SetTimeouts (min (ConnectionTimeout * 1000, rmn), min (PIWIK_RESPONSE_TIMEOUT * 1000, rmn));
+}
+
+bool PiwikDispatcher::Expired ()
+{
+	return (Draining && (LONG) (::GetTickCount () - Deadline) >= 0);
+}
+
+// Stops the service within tmo msec and reports what became of the requests still pending.
+// The service takes a last turn sending everything queued in full bundles, and lanes send what they hold until 
+// the deadline; requests that could not be sent by then are left in the journal if one is open, or dropped.
+// Exchanges are bounded by timeouts cut down to the deadline, so threads are waited for rather than terminated.
+
+PiwikShutdownReport PiwikDispatcher::Shutdown (int tmo)
+{
+	PiwikShutdownReport rpt;
+	LONGLONG snt, fld, drp;
+
+	// rollups are queued while requests are still accepted
+	ReleaseRollups (true, true);
+
+	Mutex.Activate ();
+	bool stp = Stopped;
+	Stopped = true;
+	Mutex.Release ();
+	if (stp)
+		return rpt;
+
+	snt = ::InterlockedCompareExchange64 (&SentCount, 0, 0);
+	fld = ::InterlockedCompareExchange64 (&FailedCount, 0, 0);
+	drp = ::InterlockedCompareExchange64 (&DroppedCount, 0, 0);
+
+	Deadline = ::GetTickCount () + (DWORD) max (0, tmo);
+	Draining = true;
+
+	Running = false;
+	if (Service)
+	{
+		::SetEvent (Wake);
+		::WaitForSingleObject (Service, INFINITE);
+		CloseHandle (Service), Service = 0, ServiceId = 0;
+	}
+
+	StopLanes ();
+	rpt.Persisted = Persist ();
+	Journal.Sync ();
+
+	rpt.Sent = (int) (::InterlockedCompareExchange64 (&SentCount, 0, 0) - snt);
+	rpt.Failed = (int) (::InterlockedCompareExchange64 (&FailedCount, 0, 0) - fld);
+	rpt.Dropped = (int) (::InterlockedCompareExchange64 (&DroppedCount, 0, 0) - drp);
+	rpt.Abandoned = (int) ::InterlockedCompareExchange64 (&FlyingCount, 0, 0);
+
+	if (Wake)
+		CloseHandle (Wake), Wake = 0;
+	if (Session)
+		WinHttpCloseHandle (Session), Session = 0;
+
+	return rpt;
+}
+
+// Lane threads are told to stop once the service has handed over its last requests, and finish with what they hold.
+// Asynchronous lanes are waited for to run idle; the exchange of one still busy shortly after the deadline is aborted,
+// and its requests are handed back to be persisted with the rest. Only a lane whose request handle could not be 
+// closed in time is left in place, since a callback may still reach it, and the callbacks are turned off;
+// whatever it holds besides the exchange under way is taken over.
+
+void PiwikDispatcher::StopLanes ()
+{
+	DWORD end = Deadline + PIWIK_SHUTDOWN_GRACE;
+	LONG rmn;
+	bool bsy = false;
+	size_t i, j, k;
+
+	for (i = 0; i < Lanes.size (); ++i)
+		if (Lanes[i]->Thread)
+			Lanes[i]->Stop = true, ::SetEvent (Lanes[i]->Wake);
+
+	for (i = k = 0; i < Lanes.size (); ++i)
+	{
+		rmn = max ((LONG) 0, (LONG) (end - ::GetTickCount ()));
+		if (Lanes[i]->Thread)
+			::WaitForSingleObject (Lanes[i]->Thread, INFINITE);
+		else if (Async && ::WaitForSingleObject (Lanes[i]->Wake, rmn) != WAIT_OBJECT_0 && ! AbortLane (*Lanes[i], PIWIK_SHUTDOWN_GRACE))
+		{
+			PiwikScopedLock lck (Lanes[i]->Mutex);
+
+			for ( ; ! Lanes[i]->Inbox.empty (); Lanes[i]->Inbox.pop_front ())
+			{
+				Lanes[i]->Returns.push_back (Request ());
+				swap (Lanes[i]->Returns.back (), Lanes[i]->Inbox.front ());
+			}
+			for (j = 0; j < Lanes[i]->Returns.size (); ++j)
+			{
+				Retries.push_back (Request ());
+				swap (Retries.back (), Lanes[i]->Returns[j]);
+			}
+			Lanes[i]->Returns.clear ();
+			bsy = true;
+			continue;
+		}
+		Lanes[k++] = Lanes[i];
+	}
+	Lanes.resize (k);
+
+	if (bsy)
+	{
+		Logger.Error (L"Asynchronous requests still under way at shutdown");
+		::WinHttpSetStatusCallback (Session, 0, 0, 0);
+	}
+}
+
+// Takes the exchange under way away from the callbacks of a busy asynchronous lane and closes its request handle,
+// waiting up to tmo msec for WinHTTP to report the handle closing, after which no callback can reach the lane anymore.
+// The whole bundle goes back to the service, since the requests being sent may or may not have arrived; 
+// once claimed, the callbacks leave it alone even if the handle closing is never reported.
+// If the callbacks are ending the exchange themselves, the lane is only waited for to run idle, as the deadline has passed.
+// Returns false if the lane may still be reached by a callback.
+
+bool PiwikDispatcher::AbortLane (Lane& ln, DWORD tmo)
+{
+	HINTERNET h;
+	bool cls;
+
+	if (::InterlockedExchange (&ln.Claimed, 1) != 0)
+		return (::WaitForSingleObject (ln.Wake, tmo) == WAIT_OBJECT_0);
+
+	Logger.Error (L"Aborting asynchronous request at shutdown, bundled queries: ", 0, ln.Next - ln.Start);
+	::InterlockedExchangeAdd64 (&FlyingCount, ln.Start - ln.Next);
+
+	h = ln.Http.CurrentRequest ();
+	::WinHttpSetStatusCallback (h, AsyncCallback, WINHTTP_CALLBACK_FLAG_HANDLES, 0);
+	ln.Http.Finish (false);
+	cls = (::WaitForSingleObject (ln.Wake, tmo) == WAIT_OBJECT_0);
+
+	if (ln.Start < ln.Count)
+		Release (ln, &ln.Bundle[ln.Start], ln.Count - ln.Start);
+	ln.Count = ln.Start = ln.Next = 0;
+	ln.Busy = false;
+
+	return cls;
+}
+
+// Settles every request still pending once the service and the lanes have stopped, deleting the lanes. 
+// Requests are left in the journal for the next run if possible; returns how many were.
+
+int PiwikDispatcher::Persist ()
+{
+	Request bfr[PIWIK_POST_BUNDLE];
+	std::vector<Request> lft;
+	int i, n, cnt = 0;
+
+	Collect ();
+	lft.swap (Retries);
+	for (int p = PIWIK_PRIORITY_LEVELS - 1; p >= 0; --p)
+	{
+		for ( ; ! Backlogs[p].empty (); Backlogs[p].pop_front ())
+		{
+			lft.push_back (Request ());
+			swap (lft.back (), Backlogs[p].front ());
+		}
+		while ((n = Queues[p]->Pop (bfr, PIWIK_POST_BUNDLE)) > 0)
+			for (i = 0; i < n; i++)
+			{
+				lft.push_back (Request ());
+				swap (lft.back (), bfr[i]);
+			}
+	}
+	for (size_t k = 0; k < Lanes.size (); ++k)
+	{
+		for ( ; ! Lanes[k]->Inbox.empty (); Lanes[k]->Inbox.pop_front ())
+		{
+			lft.push_back (Request ());
+			swap (lft.back (), Lanes[k]->Inbox.front ());
+		}
+		if (Lanes[k]->Thread)
+			CloseHandle (Lanes[k]->Thread);
+		if (Lanes[k]->Wake)
+			CloseHandle (Lanes[k]->Wake);
+		delete Lanes[k];
+	}
+	Lanes.clear ();
+
+	for (size_t k = 0; k < lft.size (); ++k)
+	{
+		Request& itm = lft[k];
+		if (! itm.Record && Journal.IsOpen ())
+		{
+			PiwikJournalEntry ent;
+			ent.Method = itm.Method;
+			ent.Host = Endpoints.Lookup (itm.Endpoint).Host;
+			ent.Path = Endpoints.Lookup (itm.Endpoint).Path;
+			ent.Query.swap (itm.Query);
+			itm.Record = Journal.Append (ent);
+			itm.Query.swap (ent.Query);
+		}
+		Settle (itm, (itm.Record ? PIWIK_STATUS_PERSISTED : PIWIK_STATUS_DROPPED));
+		if (itm.Record)
+			cnt++;
+	}
+
+	return cnt;
+}
+
+// Main dispatching routine run in the service thread.
+// The queue is sent when the current batch is due or when explicitly flushed; in between the service 
+// may also wake up to resend requests due for a retry, to queue rollups whose window has closed, 
+// to write the journal through to the disk, or to drop requests when the queue has gone over its budget. It ends with a last turn at shutdown.
+
+unsigned __stdcall PiwikDispatcher::ServiceRoutine (void* arg)
+{
+	PiwikDispatcher* dsp = (PiwikDispatcher*) arg;
+	bool fls, all;
+
+	if (dsp)
+		dsp->ServiceId = ::GetCurrentThreadId ();
+
+	while (dsp && dsp->Running)
+	{
+		::WaitForSingleObject (dsp->Wake, dsp->NextWakeup ());
+		fls = (::InterlockedExchange (&dsp->Flushing, 0) != 0);
+		dsp->ReleaseRollups (fls);
+		all = (fls || dsp->BatchDue ());
+
+		for (size_t i = 0; i < dsp->Lanes.size (); ++i)
+			if (! dsp->Lanes[i]->Thread)
+			{
+				PiwikScopedLock lck (dsp->Lanes[i]->Mutex);
+				if (! dsp->Lanes[i]->Busy)
+					dsp->Lanes[i]->Transport->Evict ();
+			}
+		dsp->Collect ();
+		dsp->Trim ();
+		dsp->Dispatch (all);
+		dsp->Collect ();
+		dsp->SignalRoom ();
+		dsp->Journal.Sync ();
+		dsp->DeleteRetiredRings (false);
+	}
+
+	// a last turn once the shutdown has begun, sending all that is queued whether the batch is due or not
+	if (dsp)
+	{
+		dsp->Collect ();
+		dsp->Dispatch (true);
+	}
+
+	_endthreadex (0);
+	return 0;
+}
+
+unsigned __stdcall PiwikDispatcher::LaneRoutine (void* arg)
+{
+	Lane* ln = (Lane*) arg;
+
+	ln->Owner->Serve (*ln);
+
+	_endthreadex (0);
+	return 0;
+}
+
+// Requests due for a retry are taken first, then (if all is set) pending ones from the backlog and the queue, in runs of up to one bundle.
+// Each run is either sent right away or handed over to the lanes. Sending right away, the requests to be retried are 
+// taken back before the next run, so that the later requests of their visitors wait behind them.
+
+void PiwikDispatcher::Dispatch (bool all)
+{
+	int lmt = BundleLimit;
+	int cnt, tkn, i;
+	LONGLONG byt;
+	Request* bnd;
+
+	if ((int) Bundle.size () != lmt)
+		Bundle.resize (lmt);
+	bnd = &Bundle[0];
+
+	while (1)
+	{
+		cnt = tkn = TakeRetries (bnd, lmt);
+		if (all)
+		{
+			cnt += TakeQueued (bnd + cnt, lmt - cnt);
+
+			for (byt = 0, i = tkn; i < cnt; ++i)
+				byt += bnd[i].Query.size ();
+			::InterlockedExchangeAdd (&BatchCount, tkn - cnt);
+			::InterlockedExchangeAdd64 (&BatchBytes, -byt);
+		}
+		if (! cnt)
+			break;
+		if ((cnt = tkn + HoldBack (bnd + tkn, cnt - tkn)) == 0)
+			continue;
+
+		if (Async || Lanes[0]->Thread)
+			Distribute (bnd, cnt);
+		else
+		{
+			Transmit (*Lanes[0], bnd, cnt);
+			Collect ();
+		}
+	}
+}
+
+// Hands requests over to the lanes of their visitors, keeping their order within each lane.
+// An idle asynchronous lane is claimed and its first exchange started right away.
+
+void PiwikDispatcher::Distribute (Request* bnd, int cnt)
+{
+	DWORD n = (DWORD) Lanes.size ();
+	Lane* ln;
+	int i, m;
+	bool idl;
+
+	for (DWORD k = 0; k < n; k++)
+	{
+		ln = Lanes[k];
+		ln->Mutex.Activate ();
+		for (i = m = 0; i < cnt; ++i)
+			if (bnd[i].Serial && bnd[i].Affinity % n == k)
+			{
+				ln->Inbox.push_back (Request ());
+				swap (ln->Inbox.back (), bnd[i]);
+				m++;
+			}
+		if ((idl = (Async && m && ! ln->Busy)))
+			ln->Busy = true, ::ResetEvent (ln->Wake);
+		ln->Mutex.Release ();
+
+		if (idl)
+			Advance (*ln);
+		else if (m && ln->Thread)
+			::SetEvent (ln->Wake);
+	}
+}
+
+// Takes back the requests the lanes have scheduled for a retry, or handed back otherwise.
+// The inbox of a lane that handed requests back is taken along behind them, since the lane has stopped sending.
+
+void PiwikDispatcher::Collect ()
+{
+	DWORD t = ::GetTickCount ();
+
+	for (size_t k = 0; k < Lanes.size (); ++k)
+	{
+		PiwikScopedLock lck (Lanes[k]->Mutex);
+		std::vector<Request>& rtr = Lanes[k]->Returns;
+		std::deque<Request>& inb = Lanes[k]->Inbox;
+
+		for (size_t i = 0; i < rtr.size (); ++i)
+		{
+			Retries.push_back (Request ());
+			swap (Retries.back (), rtr[i]);
+		}
+		rtr.clear ();
+
+		if (Lanes[k]->Returned)
+		{
+			for ( ; ! inb.empty (); inb.pop_front ())
+			{
+				inb.front ().Due = t;
+				Retries.push_back (Request ());
+				swap (Retries.back (), inb.front ());
+			}
+			Lanes[k]->Returned = false;
+		}
+	}
+}
+
+// Main routine of a lane thread: sends the requests arriving in its inbox, one bundle after the other.
+// Idle connections are closed whenever the lane wakes up, at the latest after the idle timeout.
+
+void PiwikDispatcher::Serve (Lane& ln)
+{
+	int lmt, cnt;
+
+	while (1)
+	{
+		::WaitForSingleObject (ln.Wake, (DWORD) ln.Transport->CurrentIdleTimeout () * 1000);
+		ln.Transport->Evict ();
+
+		while (1)
+		{
+			if ((int) ln.Bundle.size () != (lmt = BundleLimit))
+				ln.Bundle.resize (lmt);
+
+			ln.Mutex.Activate ();
+			for (cnt = 0; cnt < lmt && ! ln.Returned && ! ln.Inbox.empty (); ln.Inbox.pop_front ())
+				swap (ln.Bundle[cnt++], ln.Inbox.front ());
+			ln.Mutex.Release ();
+
+			if (! cnt)
+				break;
+			Transmit (ln, &ln.Bundle[0], cnt);
+			SignalRoom ();
+		}
+
+		if (ln.Stop)
+			break;
+	}
+}
+
+// Starts the next exchange of an asynchronous lane, taking the next bundle from its inbox once the current one is through.
+// Exchanges that fail or succeed at once are acknowledged here; the lane turns idle when nothing is left to send,
+// or hands everything back once the shutdown deadline has passed.
+// Once an exchange is under way the lane belongs to its callbacks, so nothing of it may be touched afterwards.
+
+void PiwikDispatcher::Advance (Lane& ln)
+{
+	Request* bnd;
+	int lmt, i, j, code;
+	bool idl;
+
+	while (1)
+	{
+		if (Expired ())
+		{
+			if (ln.Next < ln.Count)
+				Release (ln, &ln.Bundle[ln.Next], ln.Count - ln.Next);
+
+			ln.Mutex.Activate ();
+			for ( ; ! ln.Inbox.empty (); ln.Inbox.pop_front ())
+			{
+				ln.Inbox.front ().Due = ::GetTickCount ();
+				ln.Returns.push_back (Request ());
+				swap (ln.Returns.back (), ln.Inbox.front ());
+			}
+			ln.Count = ln.Next = 0;
+			ln.Busy = false;
+			ln.Mutex.Release ();
+
+			::SetEvent (ln.Wake);
+			return;
+		}
+
+		if (ln.Next >= ln.Count)
+		{
+			if ((int) ln.Bundle.size () != (lmt = BundleLimit))
+				ln.Bundle.resize (lmt);
+
+			ln.Mutex.Activate ();
+			for (ln.Count = 0; ln.Count < lmt && ! ln.Returned && ! ln.Inbox.empty (); ln.Inbox.pop_front ())
+				swap (ln.Bundle[ln.Count++], ln.Inbox.front ());
+			ln.Next = 0;
+			if ((idl = (ln.Count == 0)))
+				ln.Busy = false;
+			ln.Mutex.Release ();
+
+			if (idl)
+			{
+				SignalRoom ();
+				::SetEvent (ln.Wake);
+				return;
+			}
+		}
+
+		bnd = &ln.Bundle[0];
+		i = ln.Start = ln.Next;
+		j = ln.Next = i + NextBundle (ln, bnd + i, ln.Count - i);
+
+		if (j == i)
+		{
+			Defer (ln, bnd + i, ln.Count - i);
+
+			ln.Mutex.Activate ();
+			ln.Count = ln.Next = 0;
+			ln.Busy = false;
+			ln.Mutex.Release ();
+
+			::SetEvent (ln.Wake);
+			return;
+		}
+		if ((code = SendRequest (ln, bnd[i], j - i)) < 0)
+			return;
+
+		if (Acknowledge (ln, bnd + i, j - i, code))
+		{
+			Release (ln, bnd + j, ln.Count - j);
+			ln.Count = j;
+		}
+	}
+}
+
+// Ends the exchange under way in an asynchronous lane and goes on with the next one
+
+void PiwikDispatcher::Complete (Lane& ln, bool ok)
+{
+	int code = (ok ? (int) ln.Code : 0);
+	LONGLONG t = ReadClock ();
+
+	// the shutdown may have aborted the exchange already
+	if (::InterlockedExchange (&ln.Claimed, 1) != 0)
+		return;
+
+	::InterlockedExchangeAdd64 (&FlyingCount, ln.Start - ln.Next);
+	ln.Http.Finish (ok);
+	Counters.Add (PIWIK_COUNT_SEND_TIME, t - ln.Sent);
+
+	if (ok)
+	{
+		_int64 rtt = ElapsedMicroseconds (ln.Sent, t);
+		int smp = max (1, (int) (rtt / 1000));
+		RoundTrip = (RoundTrip ? (7 * RoundTrip + smp) / 8 : smp);
+		RoundTripHistogram.Record (rtt);
+
+		#ifdef PIWIK_SERVER_IS_IN_DEBUG_MODE
+			Logger.Log (L"Response: ", ln.Exchange.Response.c_str ());
+		#endif
+		if (code / 100 == 2)
+			Logger.Debug (L"Sent HTTP request, bundled queries: ", 0, ln.Next - ln.Start);
+		else
+			Logger.Error (L"Unexpected HTTP response", 0, code);
+	}
+	else
+	{
+		Logger.Error (L"HTTP request failed", 0, ln.Exchange.Error);
+	}
+
+	if (Acknowledge (ln, &ln.Bundle[ln.Start], ln.Next - ln.Start, code))
+	{
+		Release (ln, &ln.Bundle[ln.Next], ln.Count - ln.Next);
+		ln.Count = ln.Next;
+	}
+	SignalRoom ();
+	Advance (ln);
+}
+
+// WinHTTP callback driving asynchronous exchanges: once the request is sent the response is received,
+// its status code taken and its content read to the end, each step being started by the completion of the previous one.
+// The context is the lane owning the request; handles without one (sessions, connections) are of no interest.
+// Handle closing is only reported for a request aborted at shutdown, which waits for it.
+
+void CALLBACK PiwikDispatcher::AsyncCallback (HINTERNET h, DWORD_PTR ctx, DWORD sts, LPVOID info, DWORD lng)
+{
+	Lane* ln = (Lane*) ctx;
+	DWORD size;
+
+	if (! ln)
+		return;
+
+	switch (sts)
+	{
+	case WINHTTP_CALLBACK_STATUS_SENDREQUEST_COMPLETE:
+		if (! ::WinHttpReceiveResponse (h, 0))
+			ln->Exchange.Error = GetLastError (), ln->Owner->Complete (*ln, false);
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_HEADERS_AVAILABLE:
+		size = sizeof ln->Code;
+		if (! ::WinHttpQueryHeaders (h, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &ln->Code, &size, WINHTTP_NO_HEADER_INDEX))
+		{
+			ln->Exchange.Error = GetLastError (), ln->Owner->Complete (*ln, false);
+			break;
+		}
+		size = sizeof ln->Exchange.RetryAfter;
+		::WinHttpQueryHeaders (h, WINHTTP_QUERY_RETRY_AFTER | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &ln->Exchange.RetryAfter, &size, WINHTTP_NO_HEADER_INDEX);
+		if (! ::WinHttpQueryDataAvailable (h, 0))
+			ln->Exchange.Error = GetLastError (), ln->Owner->Complete (*ln, false);
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_DATA_AVAILABLE:
+		if (*(DWORD*) info == 0)
+			ln->Owner->Complete (*ln, true);
+		else if (! ::WinHttpReadData (h, ln->Buffer, min (*(DWORD*) info, (DWORD) sizeof ln->Buffer), 0))
+			ln->Exchange.Error = GetLastError (), ln->Owner->Complete (*ln, false);
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_READ_COMPLETE:
+		if (lng == 0)
+			ln->Owner->Complete (*ln, true);
+		else
+		{
+			ln->Exchange.Receive (ln->Buffer, lng);
+			if (! ::WinHttpQueryDataAvailable (h, 0))
+				ln->Exchange.Error = GetLastError (), ln->Owner->Complete (*ln, false);
+		}
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_REQUEST_ERROR:
+		ln->Exchange.Error = ((WINHTTP_ASYNC_RESULT*) info)->dwError;
+		ln->Owner->Complete (*ln, false);
+		break;
+
+	case WINHTTP_CALLBACK_STATUS_HANDLE_CLOSING:
+		::SetEvent (ln->Wake);
+		break;
+	}
+}
+
+// GET requests are sent one by one, consecutive POST requests for the same endpoint are joined into a single bulk request.
+// Once the shutdown deadline has passed nothing more is sent, and the rest is handed back to the service.
+// So is the rest once an endpoint's circuit breaker or rate limits hold an exchange back, or once requests are to be retried.
+
+void PiwikDispatcher::Transmit (Lane& ln, Request* bnd, int cnt)
+{
+	int i, j, code;
+
+	for (i = 0; i < cnt; i = j)
+	{
+		if (Expired ())
+		{
+			Release (ln, bnd + i, cnt - i);
+			return;
+		}
+
+		if ((j = i + NextBundle (ln, bnd + i, cnt - i)) == i)
+		{
+			Defer (ln, bnd + i, cnt - i);
+			return;
+		}
+
+		code = SendRequest (ln, bnd[i], j - i);
+		if (Acknowledge (ln, bnd + i, j - i, code))
+		{
+			Release (ln, bnd + j, cnt - j);
+			return;
+		}
+	}
+}
+
+// Hands requests that were not sent back to the service, along with those to be retried, due after dly msec.
+// They are always given a due time, since one left at zero would seem far off once the tick count passes 2^31.
+
+void PiwikDispatcher::Release (Lane& ln, Request* bnd, int cnt, DWORD dly)
+{
+	PiwikScopedLock lck (ln.Mutex);
+	DWORD due = ::GetTickCount () + dly;
+
+	for (int i = 0; i < cnt; ++i)
+	{
+		bnd[i].Due = due;
+		ln.Returns.push_back (Request ());
+		swap (ln.Returns.back (), bnd[i]);
+		ln.Returned = true;
+	}
+}
+
+// Hands the rest of the lane's requests back to the service, to be sent once the endpoint's budget allows.
+// Throttled requests keep their order and count no attempt; requests tracked meanwhile join them in larger bundles.
+
+void PiwikDispatcher::Defer (Lane& ln, Request* bnd, int cnt)
+{
+	DWORD due = ::GetTickCount () + ln.Deferral;
+
+	Release (ln, bnd, cnt, ln.Deferral);
+
+	ln.Mutex.Activate ();
+	for ( ; ! ln.Inbox.empty (); ln.Inbox.pop_front ())
+	{
+		ln.Inbox.front ().Due = due;
+		ln.Returns.push_back (Request ());
+		swap (ln.Returns.back (), ln.Inbox.front ());
+	}
+	ln.Mutex.Release ();
+
+	if (ln.Thread || Async)
+		::SetEvent (Wake);
+}
+
+// Unless transmission is left to explicit flushes, a batch is due when it has reached the request or byte limit,
+// or when its oldest request has waited long enough
+
+bool PiwikDispatcher::BatchDue ()
+{
+	LONG n = BatchCount;
+
+	return (DispatchInterval > 0 && n > 0 && 
+			(n >= BundleLimit || ::InterlockedCompareExchange64 (&BatchBytes, 0, 0) >= BundleSize || ::GetTickCount () - BatchStart >= Linger ()));
+}
+
+// Time the oldest request of a batch may wait. Once round trips have been measured, an adaptive batch 
+// is not held back for much longer than it takes to send it.
+
+DWORD PiwikDispatcher::Linger ()
+{
+	if (Adaptive && RoundTrip > 0)
+		return (DWORD) min (BatchAge, max (PIWIK_BATCH_LINGER, 2 * RoundTrip));
+
+	return (DWORD) BatchAge;
+}
+
+// The service wakes up when the current batch has waited long enough, or earlier if a retry becomes due before
+// or the journal has to be written through
+
+DWORD PiwikDispatcher::NextWakeup ()
+{
+	DWORD t = ::GetTickCount ();
+	DWORD w = INFINITE;
+
+	if (DispatchInterval > 0 && BatchCount > 0)
+		w = ((LONG) (BatchStart + Linger () - t) > 0 ? BatchStart + Linger () - t : 0);
+
+	for (size_t i = 0; i < Retries.size (); ++i)
+		if (! AwaitsOpening (Retries[i]))
+			w = min (w, ((LONG) (Retries[i].Due - t) > 0 ? Retries[i].Due - t : 0));
+
+	if (Journal.IsDirty ())
+		w = min (w, (DWORD) PIWIK_JOURNAL_SYNC);
+
+	Gather.Activate ();
+	w = min (w, Rollups.NextDue (t));
+	Gather.Release ();
+
+	return w;
+}
+
+// Moves requests whose backoff delay has elapsed into the bundle, keeping their original order.
+// Requests held back for the session start of their visit stay until it is settled. A request staying for its 
+// backoff delay keeps all later ones of its visitor behind it, which become due with it at the earliest;
+// the visitors concerned are noted, so that their requests taken from the queue are held back as well.
+
+int PiwikDispatcher::TakeRetries (Request* bnd, int lmt)
+{
+	DWORD t = ::GetTickCount ();
+	std::map<DWORD, DWORD>::iterator it;
+	size_t i, k;
+	int n = 0;
+	bool kpt;
+
+	Held.clear ();
+	for (i = k = 0; i < Retries.size (); ++i)
+	{
+		Request& itm = Retries[i];
+
+		if (AwaitsOpening (itm))
+			kpt = true;
+		else if ((it = Held.find (itm.Affinity)) != Held.end ())
+		{
+			kpt = true;
+			if ((LONG) (it->second - itm.Due) > 0)
+				itm.Due = it->second;
+		}
+		else if ((kpt = (n >= lmt || (LONG) (t - itm.Due) < 0)))
+			Held[itm.Affinity] = itm.Due;
+
+		if (! kpt)
+			swap (bnd[n++], itm);
+		else if (k++ != i)
+			swap (Retries[k - 1], itm);
+	}
+	Retries.resize (k);
+
+	return n;
+}
+
+// Number of requests going into the next exchange: a GET request goes alone, and so does the probe of an endpoint
+// whose circuit breaker is not closed, so that it costs as little as possible; POST requests are composed into a bundle.
+// The endpoint's circuit breaker and rate limits are consulted first, so that nothing is composed or compressed 
+// for an exchange they hold back; in that case 0 is returned, with the delay in the lane's deferral.
+
+int PiwikDispatcher::NextBundle (Lane& ln, Request* bnd, int cnt)
+{
+	PiwikEndpoint& ep = Endpoints.Lookup (bnd[0].Endpoint);
+
+	if (! DryRun && (ln.Deferral = ep.Breaker.Acquire ()) > 0)
+		return 0;
+	if (! DryRun && (ln.Deferral = ep.Limiter.Acquire (RateLimit, ByteRateLimit)) > 0)
+	{
+		ep.Breaker.Abandon ();
+		::InterlockedIncrement (&ep.Throttled);
+		Logger.Debug (L"Endpoint rate limit reached, delaying requests by msec: ", 0, (int) ln.Deferral);
+		return 0;
+	}
+
+	if (bnd[0].Method == PIWIK_METHOD_GET)
+		return 1;
+
+	return ComposeBundle (ln, bnd, (ep.Breaker.IsClosed () ? cnt : 1));
+}
+
+// Fills the bundle from the priority classes by weight: every round takes up to its weight from each class, the most
+// important first, out of its backlog and then its queue, until the bundle is full or all classes are empty.
+// So a request waits for no more rounds than its class holds requests before it divided by the class weight.
+// The time taken to serialize each request is recorded here, by the service alone, rather than by the tracking 
+// threads contending for the histogram; requests that were never serialized (replayed from the journal) have none.
+
+int PiwikDispatcher::TakeQueued (Request* bnd, int lmt)
+{
+	int n = 0, m, p, end, i;
+
+	do
+	{
+		m = n;
+		for (p = PIWIK_PRIORITY_LEVELS - 1; p >= 0 && n < lmt; --p)
+		{
+			end = n + min (Weights[p], lmt - n);
+			for ( ; n < end && ! Backlogs[p].empty (); Backlogs[p].pop_front ())
+				swap (bnd[n++], Backlogs[p].front ());
+			n += Queues[p]->Pop (bnd + n, end - n);
+		}
+	}
+	while (n < lmt && n > m);
+
+	for (i = 0; i < n; ++i)
+		if (bnd[i].Serializing >= 0)
+			SerializeHistogram.Record (bnd[i].Serializing);
+
+	return n;
+}
+
+// Moves the requests taken from the queue whose visit has a session start not settled yet over to the retries, 
+// keeping their order, and returns how many are left in the bundle. They follow once the session start is through, 
+// so that none of them reaches the server before it, whatever its priority, while other visitors are not held up.
+// Likewise requests of a visitor with an earlier request waiting for its retry join it, to be sent after it.
+
+int PiwikDispatcher::HoldBack (Request* bnd, int cnt)
+{
+	DWORD t = ::GetTickCount ();
+	std::map<DWORD, DWORD>::iterator it;
+	int i, k;
+
+	for (i = k = 0; i < cnt; ++i)
+		if (AwaitsOpening (bnd[i]) || (it = Held.find (bnd[i].Affinity)) != Held.end ())
+		{
+			bnd[i].Due = (AwaitsOpening (bnd[i]) ? t : it->second);
+			Retries.push_back (Request ());
+			swap (Retries.back (), bnd[i]);
+		}
+		else if (k++ != i)
+			swap (bnd[k - 1], bnd[i]);
+
+	return k;
+}
+
+// The bulk request body is written in place into a buffer owned by the dispatcher, which keeps its capacity
+// from one bundle to the next, so every query is copied exactly once on its way to the network.
+// Gathers the POST requests for the endpoint of the first one at the front, keeping the order of all others, 
+// then takes as many of them as fit into the bundle size and returns how many were included.
+// All requests of a visitor go to the same endpoint, so no visitor's requests are reordered; gathering stops 
+// at a GET request for the same endpoint, which has to be sent in its turn.
+
+int PiwikDispatcher::ComposeBundle (Lane& ln, Request* bnd, int cnt)
+{
+	size_t lng = 16;
+	int i, j, k, n;
+
+	for (i = k = 1; i < cnt; ++i)
+		if (bnd[i].Endpoint == bnd[0].Endpoint)
+		{
+			if (bnd[i].Method != PIWIK_METHOD_POST)
+				break;
+			for (j = i; j > k; --j)
+				swap (bnd[j], bnd[j - 1]);
+			k++;
+		}
+
+	for (n = 0; n < cnt && bnd[n].Method == PIWIK_METHOD_POST && bnd[n].Endpoint == bnd[0].Endpoint; ++n)
+	{
+		if (n > 0 && lng + bnd[n].Query.size () + 3 > (size_t) BundleSize)
+			break;
+		lng += bnd[n].Query.size () + 3;
+	}
+
+	string& body = ln.Body;
+	body.clear ();
+	body.reserve (lng);
+	body.append ("{" QUOTES "requests" QUOTES ":[");
+	for (i = 0; i < n; ++i)
+	{
+		if (i > 0)
+			body.push_back (',');
+		body.push_back ('"');
+		body.append (bnd[i].Query);
+		body.push_back ('"');
+	}
+	body.append ("]}");
+
+	return n;
+}
+
+// Records the outcome of a sent request or bundle.
+// Transient failures (no response, server errors, timeouts, throttling) are retried after an exponential backoff
+// until the retry limit is reached; any other error response is a permanent rejection and is never resent.
+// What the response to a bulk request tells about its single requests is taken into account first.
+// Returns true if requests were handed back, in which case the lane must not send anything more before the service has them.
+
+bool PiwikDispatcher::Acknowledge (Lane& ln, Request* bnd, int cnt, int code)
+{
+	bool trn = (code == 0 || code >= 500 || code == 408 || code == 429);
+	DWORD t = ::GetTickCount ();
+	int i, n = 0;
+
+	if (cnt > 0 && ! DryRun)
+	{
+		PiwikEndpoint& ep = Endpoints.Lookup (bnd[0].Endpoint);
+
+		if (ep.Breaker.Update (code > 0, BreakerThreshold, BreakerCooldown * 1000, BreakerMaxCooldown * 1000))
+		{
+			if (code > 0)
+				Logger.Info ((L"Endpoint responding again, circuit breaker closed: " + ep.Host).c_str ());
+			else
+				Logger.Error ((L"Endpoint not responding, circuit breaker opened: " + ep.Host).c_str ());
+		}
+		if (code > 0)
+			ep.Limiter.Update (code, min (ln.Exchange.RetryAfter, (DWORD) RetryMaxDelay) * 1000);
+	}
+
+	// a failed bundle settled by its response hands back the requests behind the one it stopped at
+	if (cnt > 0 && bnd[0].Method == PIWIK_METHOD_POST && AcknowledgeBulk (ln, bnd, cnt, code))
+		return (code / 100 != 2 && cnt > 1);
+
+	if (code / 100 == 2)
+	{
+		for (i = 0; i < cnt; ++i)
+			Settle (bnd[i], PIWIK_STATUS_SENT);
+		return false;
+	}
+
+	for (i = 0; i < cnt; ++i)
+	{
+		if (trn && bnd[i].Attempts < RetryLimit)
+		{
+			bnd[i].Due = t + BackoffDelay (ln, ++bnd[i].Attempts);
+			ln.Mutex.Activate ();
+			ln.Returns.push_back (Request ());
+			swap (ln.Returns.back (), bnd[i]);
+			ln.Returned = true;
+			ln.Mutex.Release ();
+			n++;
+		}
+		else
+			Settle (bnd[i], (trn ? PIWIK_STATUS_FAILED : PIWIK_STATUS_REJECTED));
+	}
+
+	Counters.Add (PIWIK_COUNT_RETRIED, n);
+
+	// the service has to learn about the retries to wake up for them
+	if (n && (ln.Thread || Async))
+		::SetEvent (Wake);
+
+	Logger.Info ((trn ? L"Request failed, retries scheduled: " : L"Request rejected by the server"), 0, n);
+
+	return (n > 0);
+}
+
+// Settles the requests of a bundle whose outcome the parsed response reports, and returns true if none is left.
+// A successful bulk request may still have skipped some requests as invalid: only these are rejected.
+// A failed one reports how many requests were tracked before the failure. These are settled as sent and moved out 
+// of the bundle, so that they are never resent; if the failure is permanent, the request it stopped at is rejected 
+// and the ones behind it, which the server has not looked at, are handed back to be sent again without counting an attempt.
+// This holds as well when the very first request failed, with none tracked.
+
+bool PiwikDispatcher::AcknowledgeBulk (Lane& ln, Request*& bnd, int& cnt, int code)
+{
+	PiwikBulkResponse& rsp = ln.Bulk;
+	std::vector<int>& inv = rsp.Indices;
+	size_t k = 0;
+	int i;
+
+	if (code <= 0 || ! rsp.Complete)
+		return false;
+
+	if (code / 100 == 2)
+	{
+		if (rsp.Invalid <= 0)
+			return false;
+
+		sort (inv.begin (), inv.end ());
+		for (i = 0; i < cnt; ++i)
+		{
+			while (k < inv.size () && inv[k] < i)
+				k++;
+			Settle (bnd[i], (k < inv.size () && inv[k] == i ? PIWIK_STATUS_REJECTED : PIWIK_STATUS_SENT));
+		}
+
+		if ((int) inv.size () < rsp.Invalid)
+			Logger.Error (L"Invalid requests in bundle not identified by the server: ", 0, rsp.Invalid - (int) inv.size ());
+		else
+			Logger.Info (L"Requests in bundle rejected as invalid: ", 0, rsp.Invalid);
+		return true;
+	}
+
+	if (rsp.Tracked < 0 || rsp.Tracked >= cnt)
+		return false;
+
+	if (rsp.Tracked > 0)
+	{
+		for (i = 0; i < rsp.Tracked; ++i)
+			Settle (bnd[i], PIWIK_STATUS_SENT);
+		bnd += rsp.Tracked, cnt -= rsp.Tracked;
+		Logger.Info (L"Requests in failed bundle tracked before the failure: ", 0, rsp.Tracked);
+	}
+
+	if (code < 500 && code != 408 && code != 429)
+	{
+		Settle (bnd[0], PIWIK_STATUS_REJECTED);
+		Release (ln, bnd + 1, cnt - 1);
+		if (cnt > 1 && (ln.Thread || Async))
+			::SetEvent (Wake);
+		return true;
+	}
+
+	return false;
+}
+
+// Delay in msec before the given attempt: doubled with each attempt up to the maximum, and randomly spread 
+// over its upper half so that many clients failing together don't all come back at the same moment
+
+int PiwikDispatcher::BackoffDelay (Lane& ln, int atm)
+{
+	int dly = RetryDelay * 1000;
+
+	while (--atm > 0 && dly < RetryMaxDelay * 1000)
+		dly *= 2;
+	dly = min (dly, RetryMaxDelay * 1000);
+
+	ln.Seed ^= ln.Seed << 13, ln.Seed ^= ln.Seed >> 17, ln.Seed ^= ln.Seed << 5;
+
+	return dly / 2 + (int) (ln.Seed % (dly / 2 + 1));
+}
+
+// Sends a GET request, or the bulk request composed from the given one onwards, through the lane's transport.
+// Returns the HTTP status code of the response, or zero if none could be obtained.
+// With the asynchronous transport, returns -1 once the request is under way; the lane's callbacks take over from there.
+// The circuit breaker and the rate limits have admitted the exchange already; its bytes are charged once it is compressed.
+
+int PiwikDispatcher::SendRequest (Lane& ln, Request& itm, int cnt)
+{
+	PiwikExchange& ex = ln.Exchange;
+	PiwikEndpoint& ep = Endpoints.Lookup (itm.Endpoint);
+	string& qry = (itm.Method == PIWIK_METHOD_GET ? itm.Query : ln.Body);
+	Request* bnd = &itm;
+	LONGLONG ts = ReadClock (), t0;
+	int code, i;
+	bool rsl;
+
+	// bulk responses are parsed as they arrive, and only kept whole when they are to be logged
+	ln.Bulk.Reset ();
+	ex.Parser = (itm.Method == PIWIK_METHOD_POST ? &ln.Bulk : 0);
+	#ifdef PIWIK_SERVER_IS_IN_DEBUG_MODE
+		ex.Keep = true;
+	#else
+		ex.Keep = false;
+	#endif
+
+	if (DryRun)
+	{
+		Logger.Log (L"DRYRUN - Not sending request: ", qry.c_str ());
+		return 200;
+	}
+
+	ex.Host = ep.Host;
+	ex.Method = itm.Method;
+	ex.Secure = Secure;
+	ex.Count = cnt;
+	ex.Headers = L"Content-Type:application/json;charset=UTF-8\r\n";
+
+	if (itm.Method == PIWIK_METHOD_GET)
+	{
+		ex.Path = ep.Path;
+		ex.Path.append (ToWide (qry));
+		ex.Data = 0, ex.Size = 0;
+	}
+	else
+	{
+		ex.Path = ep.Path;
+		ex.Data = qry.data (), ex.Size = (DWORD) qry.size ();
+
+		if (Compression != PIWIK_COMPRESSION_NONE && (int) qry.size () >= CompressionThreshold && 
+			ln.Compressor.Compress (qry, ln.Packed, Compression, CompressionLevel))
+		{
+			ex.Headers = (Compression == PIWIK_COMPRESSION_GZIP ? L"Content-Type:application/json;charset=UTF-8\r\nContent-Encoding:gzip\r\n"
+			                                                    : L"Content-Type:application/json;charset=UTF-8\r\nContent-Encoding:deflate\r\n");
+			ex.Data = ln.Packed.data (), ex.Size = (DWORD) ln.Packed.size ();
+			Logger.Debug (L"Compressed request body, percentage of original size: ", 0, (int) (ex.Size * 100 / qry.size ()));
+		}
+	}
+
+	ep.Limiter.Charge (ByteRateLimit, ex.Size);
+
+	if (Draining)
+		CapTimeouts (ln);
+
+	::InterlockedIncrement (&ep.Exchanges);
+	::InterlockedExchangeAdd64 (&ep.Bytes, ex.Size);
+	Counters.Add (PIWIK_COUNT_BUNDLES, 1);
+	Counters.Add (PIWIK_COUNT_WIRE_BYTES, ex.Size);
+
+	// requests are timed from their queuing up to their first attempt only, retries would count their backoff
+	t0 = ReadClock ();
+	CountHistogram.Record (cnt);
+	SizeHistogram.Record (qry.size ());
+	for (i = 0; i < cnt; ++i)
+		if (bnd[i].Attempts == 0 && bnd[i].Queued)
+			DelayHistogram.Record (ElapsedMicroseconds (bnd[i].Queued, t0));
+
+	if (Async)
+	{
+		ln.Code = 0, ln.Sent = t0;
+		ln.Claimed = 0;
+		::InterlockedExchangeAdd64 (&FlyingCount, cnt);
+		rsl = ln.Http.Begin (ex, (DWORD_PTR) &ln);
+		Counters.Add (PIWIK_COUNT_SEND_TIME, ReadClock () - ts);
+		if (rsl)
+			return -1;
+
+		ln.Claimed = 1;
+		::InterlockedExchangeAdd64 (&FlyingCount, -cnt);
+		Logger.Error (L"Could not send HTTP request", 0, ex.Error);
+		return 0;
+	}
+
+	code = ln.Transport->Send (ex);
+	Counters.Add (PIWIK_COUNT_SEND_TIME, ReadClock () - ts);
+
+	if (code > 0)
+	{
+		// smoothed round-trip time, weighting each new sample by 1/8
+		_int64 rtt = ElapsedMicroseconds (t0, ReadClock ());
+		int smp = max (1, (int) (rtt / 1000));
+		RoundTrip = (RoundTrip ? (7 * RoundTrip + smp) / 8 : smp);
+		RoundTripHistogram.Record (rtt);
+
+		#ifdef PIWIK_SERVER_IS_IN_DEBUG_MODE
+			Logger.Log (L"Response: ", ex.Response.c_str ());
+		#endif
+	}
+
+	if (code / 100 == 2)
+		Logger.Debug (L"Sent HTTP request: ", qry.c_str ());
+	else if (code)
+		Logger.Error (L"Unexpected HTTP response", 0, code);
+	else
+		Logger.Error (L"HTTP request failed", 0, ex.Error);
+
+	return code;
+}
+
+// PiwikStatusTable
+
+// Entries hold the serial number in their upper half and the status in the lower one
+
+PiwikStatusTable::PiwikStatusTable (int cap)
+{
+	LONG n = 2;
+	while (n < cap)
+		n <<= 1;
+
+	Entries = new LONGLONG[n];
+	for (LONG i = 0; i < n; i++)
+		Entries[i] = 0;
+	Mask = n - 1;
+}
+
+PiwikStatusTable::~PiwikStatusTable ()
+{
+	delete [] Entries;
+}
+
+// Claims the entry for a newly submitted request, evicting whatever older request was using it
+
+void PiwikStatusTable::Open (int srl)
+{
+	::InterlockedExchange64 (&Entries[srl & Mask], (LONGLONG) srl << 32 | (DWORD) PIWIK_STATUS_PENDING);
+}
+
+// Records the final outcome of a request, unless its entry has been reused in the meantime
+
+void PiwikStatusTable::Close (int srl, PiwikRequestStatus sts)
+{
+	volatile LONGLONG* e = &Entries[srl & Mask];
+	LONGLONG old = *e;
+
+	while ((int) (old >> 32) == srl)
+	{
+		LONGLONG cur = ::InterlockedCompareExchange64 (e, (LONGLONG) srl << 32 | (DWORD) sts, old);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+PiwikRequestStatus PiwikStatusTable::Lookup (int srl)
+{
+	LONGLONG e = ::InterlockedCompareExchange64 (&Entries[srl & Mask], 0, 0);
+
+	if ((int) (e >> 32) != srl)
+		return PIWIK_STATUS_UNKNOWN;
+
+	return (PiwikRequestStatus) (int) (e & 0xFFFFFFFF);
+}
+
+// PiwikEndpointTable
+
+PiwikEndpointTable::PiwikEndpointTable ()
+{
+	Items[0] = new PiwikEndpoint;
+	Count = 1;
+}
+
+PiwikEndpointTable::~PiwikEndpointTable ()
+{
+	for (LONG i = 0; i < Count; i++)
+		delete Items[i];
+}
+
+// Returns the index of the given endpoint, adding it if new, or -1 if the table is full.
+// A new entry is filled in before the count is raised, so readers only ever see complete entries.
+
+int PiwikEndpointTable::Intern (const wstring& host, const wstring& path)
+{
+	PiwikScopedLock lck (Mutex);
+	LONG i;
+
+	for (i = 0; i < Count; i++)
+		if (Items[i]->Host == host && Items[i]->Path == path)
+			return i;
+
+	if (Count == PIWIK_ENDPOINT_CAPACITY)
+		return -1;
+
+	Items[i] = new PiwikEndpoint;
+	Items[i]->Host = host;
+	Items[i]->Path = path;
+	::InterlockedIncrement (&Count);
+
+	return i;
+}
+
+// PiwikRateLimiter
+
+// Takes one exchange out of its bucket, both buckets being refilled for the time elapsed since the last call.
+// The size of the exchange is not known yet, as it is only composed and compressed once admitted: its bytes are 
+// charged afterwards and may leave the byte bucket in debt, which holds back the next exchange until it is paid.
+// Returns 0 if the exchange may go ahead, otherwise the msec until it can.
+
+DWORD PiwikRateLimiter::Acquire (int rps, int bps)
+{
+	PiwikScopedLock lck (Mutex);
+	DWORD t = ::GetTickCount ();
+	double r = rps / Slowdown, b = bps / Slowdown;
+	double dt = (Last ? (t - Last) / 1000.0 : 1.0);
+	double w = 0;
+
+	if (Holding)
+	{
+		if ((LONG) (Hold - t) > 0)
+			return Hold - t;
+		Holding = false;
+	}
+
+	Last = t;
+	if (rps > 0)
+	{
+		Exchanges = min (max (r, 1.0), Exchanges + dt * r);
+		if (Exchanges < 1)
+			w = (1 - Exchanges) / r;
+	}
+	if (bps > 0)
+	{
+		Bytes = min (max (b, 1.0), Bytes + dt * b);
+		if (Bytes < 0)
+			w = max (w, -Bytes / b);
+	}
+
+	if (w > 0)
+		return (DWORD) (w * 1000) + 1;
+
+	if (rps > 0)
+		Exchanges -= 1;
+
+	return 0;
+}
+
+// Charges the bytes of an admitted exchange, once it is ready to be sent
+
+void PiwikRateLimiter::Charge (int bps, DWORD size)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (bps > 0)
+		Bytes -= size;
+}
+
+// Slows down when the server asks for it, holding back all exchanges for the delay (msec) it gave, and recovers on success
+
+void PiwikRateLimiter::Update (int code, DWORD dly)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (code == 429 || code == 503)
+	{
+		Slowdown = min ((double) PIWIK_MAX_SLOWDOWN, Slowdown * 2);
+		if (dly > 0)
+			Hold = ::GetTickCount () + dly, Holding = true;
+	}
+	else if (code / 100 == 2 && Slowdown > 1)
+		Slowdown = max (1.0, Slowdown * 7 / 8);
+}
+
+// PiwikCircuitBreaker
+
+// Returns 0 if an exchange may go ahead, otherwise the msec to wait. The first caller after the cooldown is the probe;
+// others wait for its outcome, checking back after a second.
+
+DWORD PiwikCircuitBreaker::Acquire ()
+{
+	PiwikScopedLock lck (Mutex);
+	DWORD t = ::GetTickCount ();
+
+	switch (State)
+	{
+	case PIWIK_BREAKER_OPEN:
+		if ((LONG) (Until - t) > 0)
+			return Until - t;
+		State = PIWIK_BREAKER_HALF_OPEN;
+		Probing = true;
+		Probes++;
+		return 0;
+
+	case PIWIK_BREAKER_HALF_OPEN:
+		if (Probing)
+			return 1000;
+		Probing = true;
+		Probes++;
+		return 0;
+	}
+
+	return 0;
+}
+
+// The probe let through was not sent after all
+
+void PiwikCircuitBreaker::Abandon ()
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (State == PIWIK_BREAKER_HALF_OPEN)
+		Probing = false;
+}
+
+// Accounts for the outcome of an exchange, rsp telling whether any response was obtained.
+// Returns true if the breaker has been closed (after a response) or opened (after a failure).
+
+bool PiwikCircuitBreaker::Update (bool rsp, int lmt, DWORD dly, DWORD cap)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (rsp)
+	{
+		Failures = 0;
+		if (State == PIWIK_BREAKER_CLOSED)
+			return false;
+		State = PIWIK_BREAKER_CLOSED;
+		Probing = false;
+		Recoveries++;
+		return true;
+	}
+
+	Failures++;
+	if (State == PIWIK_BREAKER_HALF_OPEN && Probing)
+		Cooldown = min (Cooldown * 2, cap);
+	else if (State == PIWIK_BREAKER_CLOSED && lmt > 0 && Failures >= lmt)
+		Cooldown = dly;
+	else
+		return false;
+
+	State = PIWIK_BREAKER_OPEN;
+	Until = ::GetTickCount () + Cooldown;
+	Probing = false;
+	Openings++;
+
+	return true;
+}
+
+void PiwikCircuitBreaker::CollectStatistics (PiwikEndpointStatistics& sts)
+{
+	PiwikScopedLock lck (Mutex);
+
+	sts.Breaker = State;
+	sts.Openings = Openings;
+	sts.Probes = Probes;
+	sts.Recoveries = Recoveries;
+}
+
+// PiwikShardRing
+
+// Each endpoint's points are derived from its host and path, so a set yields the same ring whatever its order
+
+PiwikShardRing::PiwikShardRing (PiwikEndpointTable& tbl, std::vector<int>& ids)
+{
+	DWORD h;
+
+	Ids = ids;
+	Points.reserve (ids.size () * PIWIK_SHARD_POINTS);
+	for (size_t i = 0; i < ids.size (); ++i)
+	{
+		PiwikEndpoint& ep = tbl.Lookup (ids[i]);
+		h = ComputeHash (ep.Host.data (), ep.Host.size () * sizeof (wchar_t));
+		h = ComputeHash (ep.Path.data (), ep.Path.size () * sizeof (wchar_t)) ^ MixHash (h);
+		for (int k = 0; k < PIWIK_SHARD_POINTS; ++k)
+			Points.push_back (make_pair (MixHash (h + k * 0x9E3779B9), ids[i]));
+	}
+	sort (Points.begin (), Points.end ());
+}
+
+int PiwikShardRing::Route (DWORD key)
+{
+	std::vector<pair<DWORD, int> >::iterator it;
+
+	if (Points.empty ())
+		return 0;
+	if ((it = lower_bound (Points.begin (), Points.end (), make_pair (MixHash (key), -1))) == Points.end ())
+		it = Points.begin ();
+
+	return it->second;
+}
+
+// PiwikAggregator
+
+bool PiwikAggregator::Accepts (PiwikState& st)
+{
+	return (! st.EventCategory.empty () && ! st.NewSession && ! st.Goal && ! st.Revenue && st.OutLink.empty () && st.ContentName.empty () &&
+			! st.ScreenVariables.IsValid () && ! st.DimensionVariables.IsValid ());
+}
+
+// The key joins the selected fields with the site and visitor, separated by a character that cannot occur in them
+
+TSTRING PiwikAggregator::Key (PiwikState& st)
+{
+	TCHAR num[16];
+	TSTRING key;
+
+	_stprintf_s (num, ARRAY_COUNT (num), _T("%d"), st.SiteId);
+	key.reserve (64 + st.TrackedPath.size ());
+	key.append (num).append (1, 1).append (st.VisitorId).append (1, 1).append (st.UserId);
+	if (Keys & PIWIK_AGGREGATE_CATEGORY)
+		key.append (1, 1).append (st.EventCategory);
+	if (Keys & PIWIK_AGGREGATE_ACTION)
+		key.append (1, 1).append (st.EventAction);
+	if (Keys & PIWIK_AGGREGATE_NAME)
+		key.append (1, 1).append (st.EventName);
+	if (Keys & PIWIK_AGGREGATE_PATH)
+		key.append (1, 1).append (st.TrackedPath);
+
+	return key;
+}
+
+// Counts the event into its rollup and returns the rollup's identifier, or 0 if there is none
+
+int PiwikAggregator::Merge (PiwikState& st)
+{
+	std::map<TSTRING, Rollup>::iterator it = Items.find (Key (st));
+
+	if (it == Items.end ())
+		return 0;
+
+	it->second.Count++;
+	it->second.Total += st.EventValue;
+
+	return it->second.Serial;
+}
+
+void PiwikAggregator::Open (PiwikState& st, int srl, DWORD t)
+{
+	Rollup& r = Items[Key (st)];
+
+	r.State = st;
+	r.Serial = srl;
+	r.Count = 1;
+	r.Total = st.EventValue;
+	r.Start = t;
+}
+
+// Time until the first window closes, or INFINITE if there is none
+
+DWORD PiwikAggregator::NextDue (DWORD t)
+{
+	DWORD w = INFINITE;
+
+	for (std::map<TSTRING, Rollup>::iterator it = Items.begin (); it != Items.end (); ++it)
+		w = min (w, ((LONG) (it->second.Start + Window - t) > 0 ? it->second.Start + Window - t : 0));
+
+	return w;
+}
+
+// Hands over the rollups whose window has closed, or all, as events with their identifiers
+
+void PiwikAggregator::Take (std::vector<pair<int, PiwikState> >& trg, DWORD t, bool all)
+{
+	std::map<TSTRING, Rollup>::iterator it = Items.begin ();
+	TCHAR nam[24], cnt[16];
+
+	while (it != Items.end ())
+	{
+		Rollup& r = it->second;
+
+		if (! all && (LONG) (t - r.Start) < (LONG) Window)
+		{
+			++it;
+			continue;
+		}
+
+		trg.push_back (make_pair (r.Serial, r.State));
+		PiwikState& st = trg.back ().second;
+		st.EventValue = (float) r.Total;
+		if (Dimension > 0)
+		{
+			_stprintf_s (nam, ARRAY_COUNT (nam), _T("dimension%d"), Dimension);
+			_stprintf_s (cnt, ARRAY_COUNT (cnt), _T("%d"), r.Count);
+			st.DimensionVariables.Items[st.DimensionVariables.GetIndex (nam)].Set (nam, cnt);
+		}
+
+		Items.erase (it++);
+	}
+}
@@ -20,43 +20,417 @@
 #include <time.h>
 #include <process.h>
 #include <string>
-#include <deque>
 #include <vector>
+#include <deque>
+#include <map>
 #include <ostream>
 
 using namespace std;
 
+// Called once the outcome of a request is known, with its identifier and final status
+
+typedef void (*PiwikCompletion) (int rqst, PiwikRequestStatus sts, void* ctx);
+
+// Queue statistics: requests and bytes currently pending and their highest levels so far, 
+// requests dropped to stay within the budget and tracking calls that had to wait for room
+
+struct PiwikQueueStatistics
+{
+	int Pending;
+	_int64 PendingBytes;
+	int PeakPending;
+	_int64 PeakBytes;
+	int Dropped;
+	_int64 DroppedBytes;
+	int Blocked;
+
+	PiwikQueueStatistics () : Pending(0), PendingBytes(0), PeakPending(0), PeakBytes(0), Dropped(0), DroppedBytes(0), Blocked(0) {}
+};
+
+// Totals of the tracking pipeline since the tracker was created: tracking calls submitted and ignored while tracking 
+// was disabled, requests queued and those pending now with their bytes, exchanges and their bytes on the wire,
+// requests delivered, failed or rejected, scheduled for a retry and dropped, connections opened and reused,
+// and the time (microseconds) spent in tracking calls, serializing requests and sending exchanges
+
+struct PiwikStatistics
+{
+	_int64 Tracked;
+	_int64 Disabled;
+	_int64 Queued;
+	int Pending;
+	_int64 PendingBytes;
+	_int64 Bundles;
+	_int64 WireBytes;
+	_int64 Acknowledged;
+	_int64 Failed;
+	_int64 Retried;
+	_int64 Dropped;
+	int Opens;
+	int Reuses;
+	_int64 TrackTime;
+	_int64 SerializeTime;
+	_int64 SendTime;
+
+	PiwikStatistics () : Tracked(0), Disabled(0), Queued(0), Pending(0), PendingBytes(0), Bundles(0), WireBytes(0), Acknowledged(0),
+						 Failed(0), Retried(0), Dropped(0), Opens(0), Reuses(0), TrackTime(0), SerializeTime(0), SendTime(0) {}
+};
+
+// Distributions of the dispatcher's timings (microseconds) and bundle sizes, since creation or the last reset:
+// the time from queuing a request to its first sending, the round trip of exchanges that got a response,
+// the requests and body bytes (before compression) of every exchange, and the time taken to serialize a request
+
+struct PiwikLatencyStatistics
+{
+	PiwikHistogramSnapshot QueueDelay;
+	PiwikHistogramSnapshot RoundTrip;
+	PiwikHistogramSnapshot BundleCount;
+	PiwikHistogramSnapshot BundleBytes;
+	PiwikHistogramSnapshot Serialization;
+};
+
+// Outcome of a shutdown: requests sent, failed or rejected while draining, left in the journal for the next run,
+// and dropped (while draining, or because they could not be sent in time and there was no journal to keep them).
+// Requests of aborted asynchronous exchanges count as persisted or dropped; those of exchanges that could not
+// even be aborted are abandoned, their outcome unknown.
+
+struct PiwikShutdownReport
+{
+	int Sent;
+	int Failed;
+	int Persisted;
+	int Dropped;
+	int Abandoned;
+
+	PiwikShutdownReport () : Sent(0), Failed(0), Persisted(0), Dropped(0), Abandoned(0) {}
+};
+
+// Outcome of the most recent requests, in a ring indexed by serial number modulo its capacity.
+// Each entry packs the serial it belongs to with its status, so that lookups and updates take constant time 
+// without any lock, and a request whose entry has been reused by a newer one is reported as unknown.
+
+class PiwikStatusTable
+{
+private:
+	volatile LONGLONG* Entries;
+	LONG Mask;
+
+public:
+	PiwikStatusTable (int cap);
+	~PiwikStatusTable ();
+
+	void Open (int srl);
+	void Close (int srl, PiwikRequestStatus sts);
+	PiwikRequestStatus Lookup (int srl);
+};
+
+// Throughput of an endpoint: requests routed to it, their outcomes, the exchanges and bytes sent to it,
+// the exchanges held back by its rate limits and the factor they are currently divided by,
+// and the state of its circuit breaker with the number of times it has been opened, probed and closed again
+
+struct PiwikEndpointStatistics
+{
+	wstring Host;
+	wstring Path;
+	int Routed;
+	int Sent;
+	int Failed;
+	int Dropped;
+	int Exchanges;
+	_int64 Bytes;
+	int Throttled;
+	double Slowdown;
+	PiwikBreakerState Breaker;
+	int Openings;
+	int Probes;
+	int Recoveries;
+
+	PiwikEndpointStatistics () : Routed(0), Sent(0), Failed(0), Dropped(0), Exchanges(0), Bytes(0), Throttled(0), Slowdown(1), 
+								 Breaker(PIWIK_BREAKER_CLOSED), Openings(0), Probes(0), Recoveries(0) {}
+};
+
+// Circuit breaker of an endpoint, shared by all lanes. After a number of consecutive exchanges failing without any
+// response it opens, and nothing is sent to the endpoint for the cooldown. Then it lets a single probe through
+// (half-open): a response closes it, a failure opens it again for twice the cooldown, up to the maximum.
+
+class PiwikCircuitBreaker
+{
+private:
+	PiwikBreakerState State;
+	int Failures;
+	DWORD Cooldown;
+	DWORD Until;
+	bool Probing;
+	int Openings, Probes, Recoveries;
+	PiwikLock Mutex;
+
+public:
+	PiwikCircuitBreaker () : State(PIWIK_BREAKER_CLOSED), Failures(0), Cooldown(0), Until(0), Probing(false), Openings(0), Probes(0), Recoveries(0) {}
+
+	bool IsClosed ()                { return State == PIWIK_BREAKER_CLOSED; }
+	DWORD Acquire ();
+	void  Abandon ();
+	bool  Update (bool rsp, int lmt, DWORD dly, DWORD cap);
+	void  CollectStatistics (PiwikEndpointStatistics& sts);
+};
+
+// Token buckets for the exchanges and the bytes sent to an endpoint per second, each holding up to a second's worth,
+// shared by all lanes. While the server asks to slow down (429 or 503) the rates are divided by a factor that doubles
+// with every such response and shrinks by an eighth with every success; a Retry-After delay holds back all exchanges.
+
+class PiwikRateLimiter
+{
+private:
+	double Exchanges;
+	double Bytes;
+	double Slowdown;
+	DWORD Last;
+	DWORD Hold;
+	bool Holding;
+	PiwikLock Mutex;
+
+public:
+	PiwikRateLimiter () : Exchanges(0), Bytes(0), Slowdown(1), Last(0), Hold(0), Holding(false) {}
+
+	DWORD Acquire (int rps, int bps);
+	void  Charge (int bps, DWORD size);
+	void  Update (int code, DWORD dly);
+	double CurrentSlowdown ()       { PiwikSharedLock lck (Mutex); return Slowdown; }
+};
+
+// Endpoints requests are sent to, interned so that queued requests only carry their index in the table.
+// Entries are never changed or removed once added, so they can be read without any lock; only their counters change.
+// Index 0 holds an empty endpoint, used as long as no API URL has been set.
+
+struct PiwikEndpoint
+{
+	wstring Host;
+	wstring Path;
+	volatile LONG Routed, Sent, Failed, Dropped, Exchanges, Throttled;
+	volatile LONGLONG Bytes;
+	PiwikRateLimiter Limiter;
+	PiwikCircuitBreaker Breaker;
+
+	PiwikEndpoint () : Routed(0), Sent(0), Failed(0), Dropped(0), Exchanges(0), Throttled(0), Bytes(0) {}
+};
+
+class PiwikEndpointTable
+{
+private:
+	PiwikEndpoint* Items[PIWIK_ENDPOINT_CAPACITY];
+	volatile LONG Count;
+	PiwikLock Mutex;
+
+public:
+	PiwikEndpointTable ();
+	~PiwikEndpointTable ();
+
+	int  Intern (const wstring& host, const wstring& path);
+	int  Size ()                    { return Count; }
+	PiwikEndpoint& Lookup (int id)  { return *Items[id]; }
+};
+
+// Consistent hash ring over a set of endpoints. Every endpoint owns a number of points spread over the ring,
+// and a key belongs to the endpoint owning the first point at or after it, so that the same visitor always 
+// reaches the same endpoint, and adding or removing an endpoint only moves the visitors of that one.
+// A ring is never changed once built.
+
+class PiwikShardRing
+{
+private:
+	std::vector<pair<DWORD, int> > Points;
+	std::vector<int> Ids;
+
+public:
+	PiwikShardRing (PiwikEndpointTable& tbl, std::vector<int>& ids);
+
+	int  Route (DWORD key);
+	bool Serves (const std::vector<int>& ids)   { return Ids == ids; }
+};
+
+// Identical events gathered over a time window, to be tracked as a single event carrying their number and the sum of
+// their values. Events are identical if they share the selected keys (category, action, name, path) and the site and visitor;
+// all other fields are taken from the first event of the window. Only plain events qualify: session starts, goals,
+// content and events with variables or dimensions of their own are always tracked on their own.
+// Not synchronized: the dispatcher guards it with a lock of its own.
+
+class PiwikAggregator
+{
+private:
+	struct Rollup
+	{
+		PiwikState State;
+		int Serial;
+		int Count;
+		double Total;
+		DWORD Start;
+	};
+
+	std::map<TSTRING, Rollup> Items;
+	DWORD Window;
+	int Keys;
+	int Dimension;
+
+	TSTRING Key (PiwikState& st);
+
+public:
+	PiwikAggregator () : Window(PIWIK_AGGREGATION_WINDOW), Keys(PIWIK_AGGREGATE_DEFAULT), Dimension(0) {}
+
+	void Configure (DWORD wnd, int keys, int dim)   { Window = wnd, Keys = keys, Dimension = dim; }
+	bool IsActive ()                                 { return Window > 0; }
+	bool Accepts (PiwikState& st);
+	int  Merge (PiwikState& st);
+	void Open (PiwikState& st, int srl, DWORD t);
+	DWORD NextDue (DWORD t);
+	void Take (std::vector<pair<int, PiwikState> >& trg, DWORD t, bool all);
+};
+
 class PiwikDispatcher
 {
 private:
 	struct Request
 	{
 		int Serial;
-		wstring Host;
-		wstring Path;
+		int Endpoint;
 		PiwikMethod Method;
+		PiwikPriority Priority;
+		DWORD Affinity;
 		string Query;
+		int Attempts;
+		DWORD Due;
+		LONGLONG Queued;
+		LONGLONG Record;
+		int Serializing;
+		bool Opening;
+		PiwikCompletion Notify;
+		void* Context;
+
+		Request () : Serial(0), Endpoint(0), Method(PIWIK_METHOD_POST), Priority(PIWIK_PRIORITY_NORMAL), Affinity(0), Attempts(0), Due(0), Queued(0), Record(0), Serializing(-1), Opening(false), Notify(0), Context(0) {}
+
+		static bool IsSettled (const Request& itm)   { return itm.Serial == 0; }
+	};
+
+	// A sender with its own transport, connections and buffers. Requests are assigned to lanes by visitor, and each lane
+	// sends its bundles one after the other, so a visitor's requests keep their order while lanes run in parallel.
+	// With a single lane the service thread sends by itself; otherwise every lane runs its own thread, 
+	// taking requests from its inbox and handing requests to be retried back to the service.
+	// With the asynchronous transport lanes have no thread: each one keeps an exchange under way, driven by 
+	// WinHTTP callbacks, and starts the next one from its inbox as soon as the previous one has completed.
+
+	struct Lane
+	{
+		PiwikDispatcher* Owner;
+		HANDLE Thread;
+		HANDLE Wake;
+		PiwikLock Mutex;
+		std::deque<Request> Inbox;
+		std::vector<Request> Returns;
+		std::vector<Request> Bundle;
+		PiwikWinHttpTransport Http;
+		PiwikTransport* Transport;
+		PiwikExchange Exchange;
+		PiwikBulkResponse Bulk;
+		PiwikCompressor Compressor;
+		string Body;
+		string Packed;
+		unsigned int Seed;
+		volatile bool Stop;
+
+		// set under the mutex once requests are handed back, until the service has collected them: the lane sends 
+		// nothing more meanwhile, and the service takes its inbox back as well, so that no visitor's requests overtake.
+		bool Returned;
+
+		// asynchronous exchange: the bundle holds Count requests, those from Start to Next are being sent.
+		// Claimed is cleared when an exchange starts, and set by whoever ends it: its callbacks or the shutdown.
+		volatile bool Busy;
+		volatile LONG Claimed;
+		int Count, Start, Next;
+		DWORD Code;
+		LONGLONG Sent;
+		char Buffer[4096];
+
+		// msec until the endpoint of a throttled exchange allows it
+		DWORD Deferral;
+
+		Lane () : Owner(0), Thread(0), Wake(0), Transport(&Http), Seed(0), Stop(false), Returned(false), Busy(false), Claimed(1), Count(0), Start(0), Next(0), Code(0), Sent(0), Deferral(0) {}
+		~Lane ()        { if (Transport != &Http) delete Transport; }
 	};
 
 	TSTRING ApiUrl;
-	wstring ApiHost, ApiPath;
+	PiwikShardRing* volatile Ring;
+	std::vector<pair<DWORD, PiwikShardRing*> > Retired;
 	PiwikMethod Method;
 	int ConnectionTimeout;
 	int DispatchInterval;
+	int BundleLimit;
+	int BundleSize;
+	int BatchAge;
+	bool Adaptive;
+	int RoundTrip;
+	int Concurrency;
+	int IdleTimeout;
+	int RetryLimit;
+	int RetryDelay;
+	int RetryMaxDelay;
+	int RateLimit;
+	int ByteRateLimit;
+	int BreakerThreshold;
+	int BreakerCooldown;
+	int BreakerMaxCooldown;
 	bool Secure;
+	bool Async;
+	PiwikCompression Compression;
+	int CompressionLevel;
+	int CompressionThreshold;
+	int QueueLimit;
+	int QueueSize;
+	int QueueWait;
+	PiwikOverflowPolicy Overflow;
 	bool DryRun;
 	bool Synchronous;
 	bool Running;
+	volatile bool Stopped;
+	volatile bool Draining;
+	volatile DWORD Deadline;
 
-	std::deque<Request> Requests;
-	std::vector<int> Failures;
-	int SerialNumber;
-	int LastAcknowledged;
+	PiwikQueue<Request>* Queues[PIWIK_PRIORITY_LEVELS];
+	std::vector<Request> Retries;
+	std::map<DWORD, DWORD> Held;
+	std::deque<Request> Backlogs[PIWIK_PRIORITY_LEVELS];
+	int Weights[PIWIK_PRIORITY_LEVELS];
+	std::vector<Request> Bundle;
+	PiwikStatusTable Outcomes;
+	PiwikEndpointTable Endpoints;
+	volatile LONG SerialNumber;
+	volatile LONG Flushing;
+	volatile LONG BatchCount;
+	volatile LONGLONG BatchBytes;
+	volatile DWORD BatchStart;
+	volatile LONG Waiters;
+	volatile LONG Watchers;
+	volatile LONG Openings[PIWIK_OPENING_SLOTS];
+	volatile LONGLONG PendingCount, PendingBytes;
+	volatile LONGLONG PeakCount, PeakBytes;
+	volatile LONGLONG DroppedCount, DroppedBytes;
+	volatile LONGLONG BlockedCount;
+	volatile LONGLONG SentCount, FailedCount;
+	volatile LONGLONG FlyingCount;
+	PiwikHistogram DelayHistogram, RoundTripHistogram, CountHistogram, SizeHistogram, SerializeHistogram;
+	PiwikCounters Counters;
+	CONDITION_VARIABLE Room;
+	PiwikLock Budget;
+	CONDITION_VARIABLE Resolved;
+	PiwikLock Watch;
 	PiwikLock Mutex;
 	PiwikLogger Logger;
 	HANDLE Service;
+	DWORD ServiceId;
 	HANDLE Wake;
 	HINTERNET Session;
+	PiwikTransport* Transport;
+	std::vector<Lane*> Lanes;
+	PiwikJournal Journal;
+	PiwikAggregator Rollups;
+	PiwikLock Gather;
 
 public:
 	PiwikDispatcher ();
@@ -64,25 +438,92 @@ public:
 
 	TSTRING CurrentApiUrl ();
 	bool SetApiUrl (LPCTSTR p);
+	bool SetApiUrls (LPCTSTR* urls, int cnt);
 	int  CurrentRequestMethod ();
 	void SetRequestMethod (PiwikMethod m);
 	bool UsesSecureConnection ();
 	void SetSecureConnection (bool f);
+	void SetCompression (PiwikCompression c, int lvl, int thr);
 	void SetConnectionTimeout (int t);
+	void SetConnectionIdleTimeout (int t);
+	bool SetConcurrency (int n);
+	bool SetAsyncTransport (bool v);
+	bool SetTransport (PiwikTransport* t);
 	void SetDispatchInterval (int t);
+	void SetBatching (int cnt, int size, int age, bool adp);
+	void SetRetryPolicy (int lmt, int dly, int max);
+	void SetRateLimits (int rps, int bps);
+	void SetCircuitBreaker (int lmt, int dly, int max);
+	void SetQueueLimits (int cnt, int size, PiwikOverflowPolicy plc, int wait);
+	bool SetPriorityWeight (PiwikPriority p, int w);
+	bool SetAggregation (int wnd, int dim, int keys);
+	bool SetJournal (LPCTSTR path, int size);
 	bool IsDryRun ();
 	void SetDryRun (bool v);
 	void SetLogger (wostream* s, PiwikLogLevel lvl);
+	void CollectLockStatistics (PiwikLockStatistics& sts);
+	void ResetLockStatistics ();
+	PiwikConnectionStatistics CurrentConnectionStatistics ();
+	PiwikCompressionStatistics CurrentCompressionStatistics ();
+	PiwikQueueStatistics CurrentQueueStatistics ();
+	std::vector<PiwikEndpointStatistics> CurrentEndpointStatistics ();
+	PiwikLatencyStatistics CurrentLatencyStatistics (bool rst);
+	PiwikStatistics CurrentStatistics ();
+	void Count (PiwikCounter c, _int64 v)       { Counters.Add (c, v); }
 
-	int  Submit (PiwikState& st);
+	int  Submit (PiwikState& st, PiwikCompletion fnc = 0, void* ctx = 0);
 	bool Flush ();
 	int  RequestStatus (int rqst);
+	bool AwaitRequests (const int* rqst, int cnt, DWORD tmo);
+	PiwikShutdownReport Shutdown (int tmo);
 
 private:
+	bool ParseUrl (LPCTSTR p, TSTRING& api, bool& sec);
 	bool LaunchService ();
-	void ShutdownService ();
+	void ApplyTimeouts ();
+	void CapTimeouts (Lane& ln);
+	void StopLanes ();
+	bool AbortLane (Lane& ln, DWORD tmo);
+	int  Persist ();
+	bool Expired ();
+	int  Aggregate (PiwikState& st);
+	void ReleaseRollups (bool all, bool cls = false);
+	void DeleteRetiredRings (bool all);
+	int  Admit (PiwikState& st, PiwikCompletion fnc, void* ctx, int srl = 0);
+	static DWORD RecoverAffinity (const string& qry);
+	int  Enqueue (Request& itm);
+	bool Reserve (LONGLONG size);
+	bool Push (Request& itm);
+	bool AwaitRoom (LONGLONG size);
+	bool OverBudget ();
+	void Trim ();
+	void Settle (Request& itm, PiwikRequestStatus sts, bool rsv = true);
+	void SignalRoom ();
+	void SignalResolved ();
 	static unsigned __stdcall ServiceRoutine (void*);
-	bool SendRequest (wstring& host, wstring& path, PiwikMethod mth, string& qry);
-	void ReadResponse (HINTERNET rqst);
+	static unsigned __stdcall LaneRoutine (void*);
+	void Dispatch (bool all);
+	void Distribute (Request* bnd, int cnt);
+	void Collect ();
+	void Serve (Lane& ln);
+	void Transmit (Lane& ln, Request* bnd, int cnt);
+	void Release (Lane& ln, Request* bnd, int cnt, DWORD dly = 0);
+	void Defer (Lane& ln, Request* bnd, int cnt);
+	void Advance (Lane& ln);
+	void Complete (Lane& ln, bool ok);
+	static void CALLBACK AsyncCallback (HINTERNET h, DWORD_PTR ctx, DWORD sts, LPVOID info, DWORD lng);
+	bool BatchDue ();
+	DWORD Linger ();
+	DWORD NextWakeup ();
+	int  TakeRetries (Request* bnd, int lmt);
+	int  TakeQueued (Request* bnd, int lmt);
+	int  HoldBack (Request* bnd, int cnt);
+	bool AwaitsOpening (const Request& itm)   { return ! itm.Opening && Openings[itm.Affinity % PIWIK_OPENING_SLOTS] > 0; }
+	int  ComposeBundle (Lane& ln, Request* bnd, int cnt);
+	int  NextBundle (Lane& ln, Request* bnd, int cnt);
+	bool Acknowledge (Lane& ln, Request* bnd, int cnt, int code);
+	bool AcknowledgeBulk (Lane& ln, Request*& bnd, int& cnt, int code);
+	int  BackoffDelay (Lane& ln, int atm);
+	int  SendRequest (Lane& ln, Request& itm, int cnt);
 };
 
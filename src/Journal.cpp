@@ -0,0 +1,269 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Journal.cpp
+// Description:  Implementation of the PiwikJournal class persisting pending requests to a memory-mapped file
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Config.h"
+#include "Utilities.h"
+#include "Journal.h"
+
+#define JOURNAL_MAGIC     0x4A4B5750     // "PWKJ"
+#define JOURNAL_VERSION   2
+#define JOURNAL_WRAP      0xFFFFFFFF     // record length marking the end of the used part of the ring
+#define JOURNAL_ALIGN(n)  (((n) + 7) & ~7)
+
+// Record payload: method (1 byte), host and path (UTF-8 with a 2-byte length each), then the query itself
+
+static void PutField (string& trg, string src)
+{
+	WORD n = (WORD) src.size ();
+
+	trg.append ((char*) &n, sizeof n);
+	trg.append (src);
+}
+
+static bool GetField (const BYTE*& p, const BYTE* end, string& trg)
+{
+	WORD n;
+
+	if (end - p < (int) sizeof n)
+		return false;
+	memcpy (&n, p, sizeof n), p += sizeof n;
+	if (end - p < n)
+		return false;
+	trg.assign ((const char*) p, n), p += n;
+
+	return true;
+}
+
+PiwikJournal::PiwikJournal ()
+: File(0), Mapping(0), View(0), Size(0), Tail(0), Dirty(false)
+{
+}
+
+PiwikJournal::~PiwikJournal ()
+{
+	Close ();
+}
+
+// Opens or creates the journal file and returns the requests it still holds, in their original order.
+// These remain live records, to be completed like any other; space taken by completed records is reclaimed
+// by moving the head past them, and the ring starts over from the beginning whenever it runs empty.
+// A new file is created with the given size, an existing one keeps its own.
+
+bool PiwikJournal::Open (LPCTSTR path, int size, std::vector<PiwikJournalEntry>& pnd)
+{
+	DWORD bgn = sizeof (Header);
+	LARGE_INTEGER lng;
+	PiwikJournalEntry itm;
+	Slot slt;
+	LONGLONG id = 0;
+	DWORD pos;
+	Header* h;
+	bool vld;
+
+	Close ();
+
+	File = ::CreateFile (path, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (File == INVALID_HANDLE_VALUE)
+	{
+		File = 0;
+		return false;
+	}
+
+	if (! ::GetFileSizeEx (File, &lng))
+		lng.QuadPart = 0;
+	Size = (lng.QuadPart > (LONGLONG) bgn ? (DWORD) lng.QuadPart : (DWORD) max (size, 4096));
+
+	if (! (Mapping = ::CreateFileMapping (File, 0, PAGE_READWRITE, 0, Size, 0)) ||
+		! (View = (BYTE*) ::MapViewOfFile (Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)))
+	{
+		Close ();
+		return false;
+	}
+
+	h = Top ();
+	vld = (h->Magic == JOURNAL_MAGIC && h->Version == JOURNAL_VERSION && h->Capacity == Size && h->Head >= bgn && h->Head < Size);
+	Tail = bgn;
+
+	if (vld)
+	{
+		// walk the records from the head as long as they are intact and numbered consecutively
+		for (pos = h->Head; Decode (pos, id, itm); pos += sizeof (RecordHeader) + JOURNAL_ALIGN (((RecordHeader*) (View + pos))->Length))
+		{
+			slt.Id = id, slt.Offset = pos, slt.Done = (((RecordHeader*) (View + pos))->Done != 0);
+			Live.push_back (slt);
+			if (! slt.Done)
+				pnd.push_back (itm);
+			Tail = pos + sizeof (RecordHeader) + JOURNAL_ALIGN (((RecordHeader*) (View + pos))->Length);
+			id++;
+		}
+	}
+	else
+	{
+		h->Magic = JOURNAL_MAGIC;
+		h->Version = JOURNAL_VERSION;
+		h->Capacity = Size;
+		h->NextId = 1;
+	}
+
+	while (! Live.empty () && Live.front ().Done)
+		Live.pop_front ();
+	h->Head = (Live.empty () ? bgn : Live.front ().Offset);
+	if (id > h->NextId)
+		h->NextId = id;
+	if (Live.empty ())
+		Tail = bgn;
+
+	Dirty = true;
+
+	return true;
+}
+
+void PiwikJournal::Close ()
+{
+	if (View)
+		Sync (), ::UnmapViewOfFile (View), View = 0;
+	if (Mapping)
+		::CloseHandle (Mapping), Mapping = 0;
+	if (File)
+		::CloseHandle (File), File = 0;
+	Live.clear ();
+	Dirty = false;
+}
+
+// Stores a request and returns the number identifying its record, or zero if the journal is closed or full
+
+LONGLONG PiwikJournal::Append (PiwikJournalEntry& itm)
+{
+	DWORD bgn = sizeof (Header);
+	DWORD head, pos, need;
+	RecordHeader* r;
+	Slot slt;
+	string enc;
+
+	enc.reserve (itm.Query.size () + itm.Host.size () + itm.Path.size () + 8);
+	enc.push_back ((char) itm.Method);
+	PutField (enc, ToUTF8 (itm.Host));
+	PutField (enc, ToUTF8 (itm.Path));
+	enc.append (itm.Query);
+	need = sizeof (RecordHeader) + JOURNAL_ALIGN ((DWORD) enc.size ());
+
+	PiwikScopedLock lck (Mutex);
+
+	if (! View)
+		return 0;
+
+	if (Live.empty ())
+		Top ()->Head = Tail = bgn;
+	head = Top ()->Head;
+
+	if (Tail >= head && Size - Tail >= need)
+		pos = Tail;
+	else if (Tail >= head && head - bgn > need)
+	{
+		if (Size - Tail >= sizeof (DWORD))
+			*(DWORD*) (View + Tail) = JOURNAL_WRAP;
+		pos = bgn;
+	}
+	else if (Tail < head && head - Tail > need)
+		pos = Tail;
+	else
+		return 0;
+
+	r = (RecordHeader*) (View + pos);
+	r->Length = (DWORD) enc.size ();
+	r->Id = Top ()->NextId++;
+	r->Done = r->Reserved = 0;
+	memcpy (r + 1, enc.data (), enc.size ());
+	r->Checksum = Checksum (r);
+
+	slt.Id = r->Id, slt.Offset = pos, slt.Done = false;
+	Live.push_back (slt);
+	Tail = pos + need;
+	Dirty = true;
+
+	return slt.Id;
+}
+
+// Marks a record as finished with, and moves the head of the ring past all leading finished records
+
+void PiwikJournal::Complete (LONGLONG id)
+{
+	PiwikScopedLock lck (Mutex);
+
+	if (! View || Live.empty () || id < Live.front ().Id || id - Live.front ().Id >= (LONGLONG) Live.size ())
+		return;
+
+	Slot& slt = Live[(size_t) (id - Live.front ().Id)];
+	slt.Done = true;
+	((RecordHeader*) (View + slt.Offset))->Done = 1;
+	while (! Live.empty () && Live.front ().Done)
+		Live.pop_front ();
+
+	Top ()->Head = (Live.empty () ? Tail : Live.front ().Offset);
+	Dirty = true;
+}
+
+// Writes modified pages through to the disk. The lock is only held to check and clear the dirty flag,
+// so that tracking threads appending meanwhile are never kept waiting for the disk.
+
+bool PiwikJournal::Sync ()
+{
+	Mutex.Activate ();
+	bool drt = Dirty;
+	Dirty = false;
+	Mutex.Release ();
+
+	if (! View || ! drt)
+		return true;
+
+	return (::FlushViewOfFile (View, 0) && ::FlushFileBuffers (File));
+}
+
+// The checksum covers the number of the record and its payload, but not the flag set when it is completed
+
+DWORD PiwikJournal::Checksum (RecordHeader* r)
+{
+	return ComputeCrc32 (r + 1, r->Length, ComputeCrc32 (&r->Id, sizeof r->Id));
+}
+
+// Reads the record at the given position (or at the start of the ring if the position is past its used part).
+// If id is not zero, the record must carry that number. On success pos and id are set to those of the record.
+
+bool PiwikJournal::Decode (DWORD& pos, LONGLONG& id, PiwikJournalEntry& itm)
+{
+	RecordHeader* r;
+	const BYTE* p;
+	const BYTE* end;
+	string str;
+
+	if (pos + sizeof (RecordHeader) > Size || *(DWORD*) (View + pos) == JOURNAL_WRAP)
+		pos = sizeof (Header);
+
+	r = (RecordHeader*) (View + pos);
+	if (r->Length == 0 || r->Length > Size - pos - sizeof (RecordHeader) || (id && r->Id != id) ||
+		r->Checksum != Checksum (r))
+		return false;
+
+	p = (const BYTE*) (r + 1), end = p + r->Length;
+	itm.Method = (PiwikMethod) *p++;
+	if (! GetField (p, end, str))
+		return false;
+	itm.Host = ToWide (str);
+	if (! GetField (p, end, str))
+		return false;
+	itm.Path = ToWide (str);
+	itm.Query.assign ((const char*) p, end - p);
+	itm.Id = id = r->Id;
+
+	return true;
+}
@@ -0,0 +1,97 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Journal.h
+// Description:  Definition of the PiwikJournal class persisting pending requests to a memory-mapped file
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <windows.h>
+#include <tchar.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+using namespace std;
+
+// A request as stored in the journal
+
+struct PiwikJournalEntry
+{
+	LONGLONG Id;
+	PiwikMethod Method;
+	wstring Host;
+	wstring Path;
+	string Query;
+};
+
+// Ring of checksummed records in a memory-mapped file, holding every request not yet finished with.
+// Appending only copies the record into the mapping; writing it through to the disk is left to Sync,
+// which the service thread calls periodically. Since mapped pages belong to the system cache, records
+// already appended survive a crash of the process even before being synchronized.
+// Records are identified by consecutive numbers, and the start of the ring only moves past a record
+// once it and all records before it have been completed. Completed records are also flagged in place
+// (outside of the checksum), so that those still within the ring are not replayed.
+
+class PiwikJournal
+{
+private:
+	struct Header
+	{
+		DWORD Magic;
+		DWORD Version;
+		DWORD Capacity;
+		DWORD Head;
+		LONGLONG NextId;
+	};
+
+	struct RecordHeader
+	{
+		DWORD Length;
+		DWORD Checksum;
+		LONGLONG Id;
+		DWORD Done;
+		DWORD Reserved;
+	};
+
+	struct Slot
+	{
+		LONGLONG Id;
+		DWORD Offset;
+		bool Done;
+	};
+
+	HANDLE File;
+	HANDLE Mapping;
+	BYTE* View;
+	DWORD Size;
+	DWORD Tail;
+	std::deque<Slot> Live;
+	bool Dirty;
+	PiwikLock Mutex;
+
+public:
+	PiwikJournal ();
+	~PiwikJournal ();
+
+	bool IsOpen ()    { return View != 0; }
+
+	bool Open (LPCTSTR path, int size, std::vector<PiwikJournalEntry>& pnd);
+	void Close ();
+	LONGLONG Append (PiwikJournalEntry& itm);
+	void Complete (LONGLONG id);
+	bool Sync ();
+	bool IsDirty ()   { return Dirty; }
+
+private:
+	Header* Top ()    { return (Header*) View; }
+	DWORD Checksum (RecordHeader* r);
+	bool Decode (DWORD& pos, LONGLONG& id, PiwikJournalEntry& itm);
+};
@@ -0,0 +1,127 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Queue.h
+// Description:  Definition of the PiwikQueue class passing requests from tracking threads to the service
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <windows.h>
+#include <algorithm>
+
+using namespace std;
+
+// Bounded lock-free ring accepting items from any number of threads and delivering them to a single one.
+// Every cell carries a sequence number telling whether it is free for the producer owning that position
+// or already published for the consumer, so neither side ever has to take a lock.
+// Items are swapped in and out of the cells, so their buffers are handed over without being copied.
+
+template <typename T> class PiwikQueue
+{
+private:
+	struct Cell
+	{
+		volatile LONG Sequence;
+		T Data;
+	};
+
+	Cell* Cells;
+	LONG Mask;
+	volatile LONG Tail;
+	volatile LONG Head;
+
+public:
+	PiwikQueue (int cap);
+	~PiwikQueue ();
+
+	int  Capacity ()    { return Mask + 1; }
+	int  Count ()       { LONG n = Tail - Head; return (n > 0 ? n : 0); }
+	bool IsEmpty ()     { return Count () == 0; }
+
+	bool Push (T& itm);
+	int  Pop (T* trg, int lmt);
+};
+
+// Externals
+
+// Capacity is rounded up to the next power of two so that positions can be mapped to cells by masking
+
+template <typename T> PiwikQueue<T>::PiwikQueue (int cap)
+{
+	LONG n = 2;
+	while (n < cap)
+		n <<= 1;
+
+	Cells = new Cell[n];
+	for (LONG i = 0; i < n; i++)
+		Cells[i].Sequence = i;
+	Mask = n - 1;
+	Tail = Head = 0;
+}
+
+template <typename T> PiwikQueue<T>::~PiwikQueue ()
+{
+	delete [] Cells;
+}
+
+// Called by any thread: claims the next free position and publishes the item there.
+// On success the passed item is left holding default contents; returns false if the ring is full.
+
+template <typename T> bool PiwikQueue<T>::Push (T& itm)
+{
+	Cell* c;
+	LONG pos = Tail;
+	LONG seq, old;
+
+	while (1)
+	{
+		c = &Cells[pos & Mask];
+		seq = c->Sequence;
+		if (seq == pos)
+		{
+			if ((old = ::InterlockedCompareExchange (&Tail, pos + 1, pos)) == pos)
+				break;
+			pos = old;
+		}
+		else if (seq - pos < 0)
+			return false;
+		else
+			pos = Tail;
+	}
+
+	swap (c->Data, itm);
+	::InterlockedExchange (&c->Sequence, pos + 1);
+
+	return true;
+}
+
+// Called only by the consumer thread: takes the whole run of published items, up to lmt, in one go.
+// Returns the number of items moved into trg.
+
+template <typename T> int PiwikQueue<T>::Pop (T* trg, int lmt)
+{
+	Cell* c;
+	LONG pos = Head;
+	int n;
+
+	for (n = 0; n < lmt; n++, pos++)
+	{
+		c = &Cells[pos & Mask];
+		if (c->Sequence != pos + 1)
+			break;
+		swap (trg[n], c->Data);
+		c->Data = T ();
+		::InterlockedExchange (&c->Sequence, pos + Mask + 1);
+	}
+
+	Head = pos;
+
+	return n;
+}
@@ -90,6 +90,87 @@ string PiwikState::Serialize (PiwikQueryFormat frmt)
         qb.AddDimension(VistDimensionVariables);
     }
 
+	// the rate of a sampled request lets the server weight it accordingly
+	if (SampleDimension > 0 && SampleRate > 0 && SampleRate < 1)
+	{
+		char nam[24];
+		sprintf_s (nam, sizeof nam, "dimension%d", SampleDimension);
+		qb.AddParameter (nam, SampleRate);
+	}
+
 	return qb.Result ();
 }
 
+// PiwikSampler
+
+PiwikSampler::PiwikSampler ()
+{
+	for (int i = 0; i < ARRAY_COUNT (Methods); i++)
+		Methods[i] = 1;
+	Position = 0;
+	Active = false;
+}
+
+// The position is spread evenly by the finalizer of MurmurHash3, so that similar IDs land far apart
+
+void PiwikSampler::SetVisitor (TSTRING& id)
+{
+	Position = MixHash (ComputeHash (id.data (), id.size () * sizeof (TCHAR)));
+}
+
+void PiwikSampler::SetRate (PiwikTrackingKind knd, double rate)
+{
+	Methods[knd] = rate;
+	Active = true;
+}
+
+// A rule for a category applies to all its actions unless one is given; setting a rate to 1 removes the rule
+
+void PiwikSampler::SetRate (LPCTSTR ctg, LPCTSTR act, double rate)
+{
+	TSTRING c = ctg, a = (act ? act : _T(""));
+	size_t i;
+
+	for (i = 0; i < Rules.size (); i++)
+		if (Rules[i].Category == c && Rules[i].Action == a)
+			break;
+
+	if (rate >= 1)
+	{
+		if (i < Rules.size ())
+			Rules.erase (Rules.begin () + i);
+	}
+	else
+	{
+		if (i == Rules.size ())
+		{
+			Rules.push_back (Rule ());
+			Rules[i].Category = c, Rules[i].Action = a;
+		}
+		Rules[i].Rate = rate;
+	}
+
+	Active = true;
+}
+
+double PiwikSampler::Rate (PiwikTrackingKind knd, LPCTSTR ctg, LPCTSTR act)
+{
+	double rate = Methods[knd];
+	bool spc = false;
+
+	if (! Active)
+		return 1;
+
+	if (ctg && *ctg)
+		for (size_t i = 0; i < Rules.size (); i++)
+			if (Rules[i].Category == ctg)
+			{
+				if (Rules[i].Action.empty () && ! spc)
+					rate = Rules[i].Rate;
+				else if (act && Rules[i].Action == act)
+					rate = Rules[i].Rate, spc = true;
+			}
+
+	return rate;
+}
+
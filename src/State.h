@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <time.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -34,9 +35,10 @@ struct PiwikBasicState
     PiwikVisitDimensionsSet VistDimensionVariables;
 	int Recording;
 	int ReturnImage;
+	int SampleDimension;
 
 	PiwikBasicState () : SiteId(0), ApiVersion(PIWIK_API_VERSION), UserAgent(PIWIK_USER_AGENT), 
-                         Recording(PIWIK_RECORDING_VALUE), ReturnImage(PIWIK_SEND_IMAGE)
+                         Recording(PIWIK_RECORDING_VALUE), ReturnImage(PIWIK_SEND_IMAGE), SampleDimension(0)
     { 
     }
 };
@@ -64,12 +66,48 @@ struct PiwikState : public PiwikBasicState
 	time_t LastVisit;
 	int Random;
     int AmountOfTime;
+	float SampleRate;
+	PiwikTrackingKind Kind;
+	PiwikPriority Priority;
 
 	PiwikState (): NewSession(0), VisitCount(0), FirstVisit(0), LastVisit(0), 
-                   EventValue(0), Goal(0), Revenue(0), Random(0), AmountOfTime(0)
+                   EventValue(0), Goal(0), Revenue(0), Random(0), AmountOfTime(0), SampleRate(0),
+                   Kind(PIWIK_TRACK_CUSTOM), Priority(PIWIK_PRIORITY_AUTO)
     {
     }
 								
 	string Serialize (PiwikQueryFormat frmt);
 };
 
+// Sampling rates (0 to 1) by tracking method, event category and event action, all 1 unless set.
+// The most specific rate applies: one set for a category and action, then one for the category alone, then the method's.
+// Whether a request is kept depends only on the visitor and the rate: the visitor ID is hashed to a fixed position,
+// and requests are kept if it falls below the rate. So a visitor keeps all or none of the requests sampled at the 
+// same rate, and those kept at a lower rate are a subset of the ones kept at a higher rate.
+
+class PiwikSampler
+{
+private:
+	struct Rule
+	{
+		TSTRING Category;
+		TSTRING Action;
+		double Rate;
+	};
+
+	double Methods[PIWIK_TRACK_KINDS];
+	std::vector<Rule> Rules;
+	DWORD Position;
+	bool Active;
+
+public:
+	PiwikSampler ();
+
+	void SetVisitor (TSTRING& id);
+	void SetRate (PiwikTrackingKind knd, double rate);
+	void SetRate (LPCTSTR ctg, LPCTSTR act, double rate);
+
+	double Rate (PiwikTrackingKind knd, LPCTSTR ctg = 0, LPCTSTR act = 0);
+	bool Keep (double rate)              { return (rate >= 1 || Position < rate * 4294967296.0); }
+};
+
@@ -0,0 +1,693 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Transport.cpp
+// Description:  Implementation of the PiwikTransport classes carrying HTTP requests to the tracking server
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the socket headers have to come before windows.h, which would otherwise pull in the old ones
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+// the socket transport needs Winsock, which applications linking the library would otherwise have to add themselves
+#pragma comment(lib, "ws2_32.lib")
+
+#include "Config.h"
+#include "Utilities.h"
+#include "Transport.h"
+
+// PiwikWinHttpTransport
+
+PiwikTransport* PiwikWinHttpTransport::Clone ()
+{
+	PiwikWinHttpTransport* t = new PiwikWinHttpTransport;
+
+	t->Handles.SetSession (Handles.CurrentSession ());
+	t->Handles.SetIdleTimeout (Handles.CurrentIdleTimeout ());
+	t->SetTimeouts (ConnectTimeout, ResponseTimeout);
+
+	return t;
+}
+
+// Opens a request on a pooled connection, keeping both in the transport until the exchange is finished
+
+HINTERNET PiwikWinHttpTransport::Open (PiwikExchange& ex)
+{
+	DWORD opts;
+
+	if (! (Connection = Handles.Acquire (ex.Host, ex.Secure)))
+	{
+		ex.Error = GetLastError ();
+		return 0;
+	}
+
+	Handle = ::WinHttpOpenRequest (Connection, (ex.Method == PIWIK_METHOD_GET ? L"GET" : L"POST"), ex.Path.c_str (), 0, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES,
+								   WINHTTP_FLAG_ESCAPE_DISABLE_QUERY | WINHTTP_FLAG_REFRESH | (ex.Secure ? WINHTTP_FLAG_SECURE : 0));
+	if (! Handle)
+	{
+		ex.Error = GetLastError ();
+		Handles.Discard (Connection);
+		Connection = 0;
+		return 0;
+	}
+
+	opts = SECURITY_FLAG_IGNORE_CERT_CN_INVALID | SECURITY_FLAG_IGNORE_CERT_DATE_INVALID | SECURITY_FLAG_IGNORE_UNKNOWN_CA | SECURITY_FLAG_IGNORE_CERT_WRONG_USAGE;
+	::WinHttpSetOption (Handle, WINHTTP_OPTION_SECURITY_FLAGS, &opts, sizeof opts);
+	if (ConnectTimeout > 0)
+		::WinHttpSetTimeouts (Handle, ConnectTimeout, ConnectTimeout, ResponseTimeout, ResponseTimeout);
+
+	return Handle;
+}
+
+int PiwikWinHttpTransport::Send (PiwikExchange& ex)
+{
+	DWORD code = 0;
+	DWORD size = sizeof code;
+	bool rsl;
+
+	ex.Restart ();
+	if (! Open (ex))
+		return 0;
+
+	rsl = ::WinHttpSendRequest (Handle, ex.Headers, -1, (LPVOID) ex.Data, ex.Size, ex.Size, 0) &&
+		  ::WinHttpReceiveResponse (Handle, 0) &&
+		  ::WinHttpQueryHeaders (Handle, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER,
+								 WINHTTP_HEADER_NAME_BY_INDEX, &code, &size, WINHTTP_NO_HEADER_INDEX);
+	if (rsl)
+	{
+		size = sizeof ex.RetryAfter;
+		::WinHttpQueryHeaders (Handle, WINHTTP_QUERY_RETRY_AFTER | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX, &ex.RetryAfter, &size, WINHTTP_NO_HEADER_INDEX);
+		ReadResponse (ex);
+	}
+	else
+		ex.Error = GetLastError (), code = 0;
+
+	Finish (rsl);
+
+	return (int) code;
+}
+
+// The response has to be read to the end so that the connection can be kept alive for the next request.
+// Its content is handed over piece by piece.
+
+void PiwikWinHttpTransport::ReadResponse (PiwikExchange& ex)
+{
+	char bfr[4096];
+	DWORD size = 0, wrt = 0;
+
+	while (::WinHttpQueryDataAvailable (Handle, &size) && size > 0)
+	{
+		if (! ::WinHttpReadData (Handle, (void*) bfr, min (size, (DWORD) sizeof bfr), &wrt) || ! wrt)
+			break;
+		ex.Receive (bfr, wrt);
+	}
+}
+
+// Starts an asynchronous exchange, whose callbacks receive ctx as their context.
+// Returns false if it could not be started, in which case it is already finished.
+
+bool PiwikWinHttpTransport::Begin (PiwikExchange& ex, DWORD_PTR ctx)
+{
+	ex.Restart ();
+	if (! Open (ex))
+		return false;
+
+	if (::WinHttpSendRequest (Handle, ex.Headers, -1, (LPVOID) ex.Data, ex.Size, ex.Size, ctx))
+		return true;
+
+	ex.Error = GetLastError ();
+	Finish (false);
+
+	return false;
+}
+
+// Closes the request of the current exchange; a connection that failed is not reused
+
+void PiwikWinHttpTransport::Finish (bool ok)
+{
+	if (Handle)
+		::WinHttpCloseHandle (Handle);
+	if (Connection && ! ok)
+		Handles.Discard (Connection);
+	Handle = Connection = 0;
+}
+
+// PiwikConnectHandlePool
+
+// Returns a connect handle for the given host, reusing the one kept for it if available.
+// The host may carry an explicit port ("name:port"), otherwise the default port for the scheme is used.
+
+HINTERNET PiwikConnectHandlePool::Acquire (wstring& host, bool sec)
+{
+	Entry cnn;
+	size_t j = host.find (':');
+
+	cnn.Host = host.substr (0, j);
+	cnn.Port = (j != wstring::npos ? (INTERNET_PORT) _wtoi (host.c_str () + j + 1) : (sec ? INTERNET_DEFAULT_HTTPS_PORT : INTERNET_DEFAULT_HTTP_PORT));
+	cnn.Secure = sec;
+	cnn.LastUsed = ::GetTickCount ();
+
+	for (size_t i = 0; i < Items.size (); ++i)
+		if (Items[i].Port == cnn.Port && Items[i].Secure == sec && Items[i].Host == cnn.Host)
+		{
+			Items[i].LastUsed = cnn.LastUsed;
+			Statistics.Reuses++;
+			return Items[i].Handle;
+		}
+
+	if (! (cnn.Handle = ::WinHttpConnect (Session, cnn.Host.c_str (), cnn.Port, 0)))
+		return 0;
+
+	Items.push_back (cnn);
+	Statistics.Opens++;
+
+	return cnn.Handle;
+}
+
+// Closes the handle of a request that failed, so that the next request to the same host starts afresh
+
+void PiwikConnectHandlePool::Discard (HINTERNET cnn)
+{
+	for (size_t i = 0; i < Items.size (); ++i)
+		if (Items[i].Handle == cnn)
+		{
+			::WinHttpCloseHandle (cnn);
+			Items.erase (Items.begin () + i);
+			return;
+		}
+}
+
+void PiwikConnectHandlePool::Evict ()
+{
+	DWORD t = ::GetTickCount ();
+
+	for (size_t i = Items.size (); i-- > 0; )
+		if (t - Items[i].LastUsed > (DWORD) IdleTimeout * 1000)
+		{
+			::WinHttpCloseHandle (Items[i].Handle);
+			Items.erase (Items.begin () + i);
+			Statistics.Evictions++;
+		}
+}
+
+void PiwikConnectHandlePool::Clear ()
+{
+	for (size_t i = 0; i < Items.size (); ++i)
+		::WinHttpCloseHandle (Items[i].Handle);
+	Items.clear ();
+}
+
+// PiwikBulkResponse
+
+void PiwikBulkResponse::Reset ()
+{
+	Depth = 0;
+	Quoted = Escaped = Numeric = Value = Listing = false;
+	Token.clear ();
+	Key.clear ();
+	Success = Complete = false;
+	Tracked = Invalid = -1;
+	Indices.clear ();
+}
+
+// Runs through the content one character at a time, keeping only the current key and token between calls.
+// Tokens are capped, since none of the values looked for is long.
+
+void PiwikBulkResponse::Feed (const char* data, size_t size)
+{
+	char c;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		c = data[i];
+
+		if (Quoted)
+		{
+			if (Escaped)
+				Escaped = false;
+			else if (c == '\\')
+				Escaped = true;
+			else if (c == '"')
+			{
+				Quoted = false;
+				if (Depth == 1 && ! Value)
+					Key = Token;
+				else if (Depth == 1 && Key == "status")
+					Success = (Token == "success");
+			}
+			else if (Token.size () < 32)
+				Token.push_back (c);
+			continue;
+		}
+
+		switch (c)
+		{
+		case '"':
+			Quoted = true;
+			Token.clear ();
+			break;
+
+		case '{':
+		case '[':
+			EndToken ();
+			if (++Depth == 2 && c == '[' && Value && Key == "invalid_indices")
+				Listing = true;
+			break;
+
+		case '}':
+		case ']':
+			EndToken ();
+			if (--Depth == 1)
+				Listing = false;
+			else if (Depth == 0)
+				Complete = true;
+			break;
+
+		case ':':
+			if (Depth == 1)
+				Value = true;
+			break;
+
+		case ',':
+			EndToken ();
+			if (Depth == 1)
+				Value = false;
+			break;
+
+		default:
+			if ((c >= '0' && c <= '9') || c == '-')
+			{
+				if (! Numeric)
+					Token.clear (), Numeric = true;
+				if (Token.size () < 32)
+					Token.push_back (c);
+			}
+			else
+				EndToken ();
+		}
+	}
+}
+
+void PiwikBulkResponse::EndToken ()
+{
+	int v;
+
+	if (! Numeric)
+		return;
+	Numeric = false;
+	v = atoi (Token.c_str ());
+
+	if (Depth == 1 && Value && Key == "tracked")
+		Tracked = v;
+	else if (Depth == 1 && Value && Key == "invalid")
+		Invalid = v;
+	else if (Depth == 2 && Listing)
+		Indices.push_back (v);
+}
+
+// PiwikSocketTransport
+
+PiwikSocketTransport::PiwikSocketTransport ()
+: Socket(INVALID_SOCKET), LastUsed(0), Statistics()
+{
+	WSADATA wsa;
+
+	ConnectTimeout = PIWIK_CONNECTION_TIMEOUT * 1000;
+	ResponseTimeout = PIWIK_RESPONSE_TIMEOUT * 1000;
+	IdleTimeout = PIWIK_CONNECTION_IDLE_TIMEOUT;
+	Started = (::WSAStartup (MAKEWORD (2, 2), &wsa) == 0);
+}
+
+PiwikSocketTransport::~PiwikSocketTransport ()
+{
+	Close ();
+	if (Started)
+		::WSACleanup ();
+}
+
+PiwikTransport* PiwikSocketTransport::Clone ()
+{
+	PiwikSocketTransport* t = new PiwikSocketTransport;
+
+	t->SetTimeouts (ConnectTimeout, ResponseTimeout);
+	t->SetIdleTimeout (IdleTimeout);
+
+	return t;
+}
+
+// Sends the exchange over the kept-alive connection if it leads to the same host, otherwise over a new one.
+// Since the server may have closed a kept-alive connection in the meantime, a failure on it is retried once on a fresh one.
+
+int PiwikSocketTransport::Send (PiwikExchange& ex)
+{
+	wstring hdrs = ex.Headers;
+	string hst = ToUTF8 (ex.Host);
+	string prt = "80";
+	string rqst;
+	size_t j = hst.find (':');
+	char num[16];
+	bool keep, reused;
+	DWORD ms;
+	int code;
+
+	ex.Restart ();
+	if (ex.Secure)
+	{
+		ex.Error = ERROR_NOT_SUPPORTED;
+		return 0;
+	}
+
+	if (j != string::npos)
+		prt = hst.substr (j + 1), hst.erase (j);
+	if (Socket != INVALID_SOCKET && (hst != Host || prt != Port))
+		Close ();
+	Host = hst, Port = prt;
+
+	sprintf_s (num, sizeof num, "%lu", ex.Size);
+	rqst.reserve (256 + ex.Path.size ());
+	rqst.append ((ex.Method == PIWIK_METHOD_GET ? "GET " : "POST ")).append (ToUTF8 (ex.Path)).append (" HTTP/1.1\r\n");
+	rqst.append ("Host: ").append (ToUTF8 (ex.Host)).append ("\r\n");
+	rqst.append ("User-Agent: Piwik Desktop Client\r\n");
+	if (ex.Method != PIWIK_METHOD_GET)
+		rqst.append ("Content-Length: ").append (num).append ("\r\n");
+	rqst.append (ToUTF8 (hdrs)).append ("\r\n");
+
+	for (int atm = 0; atm < 2; atm++)
+	{
+		if (! (reused = (Socket != INVALID_SOCKET)) && ! Connect ())
+			return 0;
+		if (reused)
+			Statistics.Reuses++;
+
+		// timeouts may have changed since the connection was made
+		ms = ResponseTimeout;
+		::setsockopt (Socket, SOL_SOCKET, SO_RCVTIMEO, (const char*) &ms, sizeof ms);
+		::setsockopt (Socket, SOL_SOCKET, SO_SNDTIMEO, (const char*) &ms, sizeof ms);
+
+		if (Write (rqst.data (), rqst.size ()) && Write ((const char*) ex.Data, ex.Size) && (code = Receive (ex, keep)) > 0)
+		{
+			if (keep)
+				LastUsed = ::GetTickCount ();
+			else
+				Close ();
+			return code;
+		}
+
+		ex.Error = ::WSAGetLastError ();
+		Close ();
+		if (! reused)
+			break;
+		ex.Restart ();
+	}
+
+	return 0;
+}
+
+// Connects to the current host, waiting no longer than the connection timeout
+
+bool PiwikSocketTransport::Connect ()
+{
+	struct addrinfo hnt, *lst = 0, *a;
+	u_long nbl;
+	fd_set wrt, exc;
+	timeval tmo;
+	int err, lng;
+	BOOL on = TRUE;
+
+	if (! Started)
+		return false;
+
+	ZeroMemory (&hnt, sizeof hnt);
+	hnt.ai_family = AF_UNSPEC;
+	hnt.ai_socktype = SOCK_STREAM;
+	hnt.ai_protocol = IPPROTO_TCP;
+	if (::getaddrinfo (Host.c_str (), Port.c_str (), &hnt, &lst) != 0)
+		return false;
+
+	for (a = lst; a && Socket == INVALID_SOCKET; a = a->ai_next)
+	{
+		if ((Socket = ::socket (a->ai_family, a->ai_socktype, a->ai_protocol)) == INVALID_SOCKET)
+			continue;
+
+		// the connection is made without blocking, so that its time can be limited
+		nbl = 1;
+		::ioctlsocket (Socket, FIONBIO, &nbl);
+		if (::connect (Socket, a->ai_addr, (int) a->ai_addrlen) != 0 && ::WSAGetLastError () == WSAEWOULDBLOCK)
+		{
+			FD_ZERO (&wrt);
+			FD_SET (Socket, &wrt);
+			FD_ZERO (&exc);
+			FD_SET (Socket, &exc);
+			tmo.tv_sec = ConnectTimeout / 1000, tmo.tv_usec = (ConnectTimeout % 1000) * 1000;
+			err = 1, lng = sizeof err;
+			if (::select (0, 0, &wrt, &exc, &tmo) == 1 && FD_ISSET (Socket, &wrt))
+				::getsockopt (Socket, SOL_SOCKET, SO_ERROR, (char*) &err, &lng);
+		}
+		else
+			err = ::WSAGetLastError ();
+
+		if (err)
+		{
+			::closesocket (Socket);
+			Socket = INVALID_SOCKET;
+			continue;
+		}
+
+		nbl = 0;
+		::ioctlsocket (Socket, FIONBIO, &nbl);
+		::setsockopt (Socket, IPPROTO_TCP, TCP_NODELAY, (const char*) &on, sizeof on);
+	}
+
+	::freeaddrinfo (lst);
+	if (Socket == INVALID_SOCKET)
+		return false;
+
+	Input.clear ();
+	LastUsed = ::GetTickCount ();
+	Statistics.Opens++;
+
+	return true;
+}
+
+void PiwikSocketTransport::Close ()
+{
+	if (Socket != INVALID_SOCKET)
+		::closesocket (Socket);
+	Socket = INVALID_SOCKET;
+	Input.clear ();
+}
+
+void PiwikSocketTransport::Evict ()
+{
+	if (Socket != INVALID_SOCKET && ::GetTickCount () - LastUsed > (DWORD) IdleTimeout * 1000)
+	{
+		Close ();
+		Statistics.Evictions++;
+	}
+}
+
+bool PiwikSocketTransport::Write (const char* data, size_t size)
+{
+	int n;
+
+	while (size > 0)
+	{
+		if ((n = ::send (Socket, data, (int) min (size, (size_t) 0x10000), 0)) <= 0)
+			return false;
+		data += n, size -= n;
+	}
+
+	return true;
+}
+
+// Appends whatever has arrived to the input; returns false once the connection is closed or has failed
+
+bool PiwikSocketTransport::Fill ()
+{
+	char bfr[4096];
+	int n;
+
+	if ((n = ::recv (Socket, bfr, sizeof bfr, 0)) <= 0)
+		return false;
+	Input.append (bfr, n);
+
+	return true;
+}
+
+bool PiwikSocketTransport::ReadLine (string& line)
+{
+	size_t j;
+
+	while ((j = Input.find ("\r\n")) == string::npos)
+		if (! Fill ())
+			return false;
+
+	line.assign (Input, 0, j);
+	Input.erase (0, j + 2);
+
+	return true;
+}
+
+// Hands the given number of bytes of content over to the exchange as they arrive
+
+bool PiwikSocketTransport::ReadBody (size_t size, PiwikExchange& ex)
+{
+	size_t n;
+
+	while (size > 0)
+	{
+		if (Input.empty () && ! Fill ())
+			return false;
+		n = min (size, Input.size ());
+		ex.Receive (Input.data (), n);
+		Input.erase (0, n);
+		size -= n;
+	}
+
+	return true;
+}
+
+// Reads the status line, the headers and the content of the response, which is delimited by its length,
+// sent in chunks or ends with the connection. Tells whether the connection may be kept for the next request.
+
+int PiwikSocketTransport::Receive (PiwikExchange& ex, bool& keep)
+{
+	string line, name;
+	size_t lng = 0, j;
+	bool chnk = false, sized = false;
+	int code;
+
+	if (! ReadLine (line) || line.compare (0, 5, "HTTP/") != 0 || (j = line.find (' ')) == string::npos || (code = atoi (line.c_str () + j + 1)) <= 0)
+		return 0;
+	keep = (line.compare (0, 8, "HTTP/1.0") != 0);
+
+	while (ReadLine (line) && ! line.empty ())
+	{
+		if ((j = line.find (':')) == string::npos)
+			continue;
+		name = line.substr (0, j);
+		for (j++; j < line.size () && line[j] == ' '; j++)
+			;
+		if (_stricmp (name.c_str (), "Content-Length") == 0)
+			lng = (size_t) _atoi64 (line.c_str () + j), sized = true;
+		else if (_stricmp (name.c_str (), "Transfer-Encoding") == 0 && _stricmp (line.c_str () + j, "identity") != 0)
+			chnk = true;
+		else if (_stricmp (name.c_str (), "Retry-After") == 0)
+			ex.RetryAfter = (DWORD) max (0, atoi (line.c_str () + j));
+		else if (_stricmp (name.c_str (), "Connection") == 0)
+			keep = (_stricmp (line.c_str () + j, "close") != 0);
+	}
+	if (! line.empty ())
+		return 0;
+
+	if (chnk)
+	{
+		do
+		{
+			if (! ReadLine (line))
+				return 0;
+			if ((lng = strtoul (line.c_str (), 0, 16)) > 0 && (! ReadBody (lng, ex) || ! ReadLine (line)))
+				return 0;
+		}
+		while (lng > 0);
+
+		// trailers, if any, up to the final empty line
+		do
+			if (! ReadLine (line))
+				return 0;
+		while (! line.empty ());
+	}
+	else if (sized)
+	{
+		if (! ReadBody (lng, ex))
+			return 0;
+	}
+	else
+	{
+		do
+		{
+			ex.Receive (Input.data (), Input.size ());
+			Input.clear ();
+		}
+		while (Fill ());
+		keep = false;
+	}
+
+	return code;
+}
+
+// PiwikLoopbackTransport
+
+PiwikLoopbackTransport::PiwikLoopbackTransport (int lat, int bnd, double err, int code)
+: Origin(0), Latency(max (0, lat)), Bandwidth(max (0, bnd)), ErrorRate(err), ErrorCode(code)
+{
+	Seed = ::GetTickCount () ^ (unsigned int) (DWORD_PTR) this;
+	Exchanges = Failures = Requests = 0;
+	Bytes = 0;
+}
+
+// Clones count into the statistics of the transport they were made from
+
+PiwikTransport* PiwikLoopbackTransport::Clone ()
+{
+	PiwikLoopbackTransport* t = new PiwikLoopbackTransport (Latency, Bandwidth, ErrorRate, ErrorCode);
+
+	t->Origin = (Origin ? Origin : this);
+
+	return t;
+}
+
+// Waits as long as the exchange would take and answers it, unless it is picked to fail
+
+int PiwikLoopbackTransport::Send (PiwikExchange& ex)
+{
+	PiwikLoopbackTransport* org = (Origin ? Origin : this);
+	DWORD dly = (DWORD) Latency;
+	char bfr[96];
+	int n;
+
+	ex.Restart ();
+	if (Bandwidth > 0)
+		dly += (DWORD) ((_int64) ex.Size * 1000 / Bandwidth);
+	if (dly > 0)
+		::Sleep (dly);
+
+	::InterlockedIncrement (&org->Exchanges);
+	::InterlockedExchangeAdd64 (&org->Bytes, ex.Size);
+
+	Seed ^= Seed << 13, Seed ^= Seed >> 17, Seed ^= Seed << 5;
+	if (ErrorRate > 0 && (Seed % 1000000) < ErrorRate * 1000000)
+	{
+		::InterlockedIncrement (&org->Failures);
+		if (! ErrorCode)
+			ex.Error = ERROR_CONNECTION_ABORTED;
+		return ErrorCode;
+	}
+
+	::InterlockedExchangeAdd (&org->Requests, ex.Count);
+	if (ex.Method == PIWIK_METHOD_POST)
+	{
+		n = sprintf_s (bfr, sizeof bfr, "{" QUOTES "status" QUOTES ":" QUOTES "success" QUOTES "," QUOTES "tracked" QUOTES ":%d," QUOTES "invalid" QUOTES ":0}", ex.Count);
+		ex.Receive (bfr, n);
+	}
+
+	return 200;
+}
+
+PiwikLoopbackStatistics PiwikLoopbackTransport::CurrentLoopbackStatistics ()
+{
+	PiwikLoopbackStatistics sts;
+
+	sts.Exchanges = ::InterlockedCompareExchange (&Exchanges, 0, 0);
+	sts.Failures = ::InterlockedCompareExchange (&Failures, 0, 0);
+	sts.Requests = ::InterlockedCompareExchange (&Requests, 0, 0);
+	sts.Bytes = ::InterlockedCompareExchange64 (&Bytes, 0, 0);
+
+	return sts;
+}
@@ -0,0 +1,261 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         Transport.h
+// Description:  Definition of the PiwikTransport classes carrying HTTP requests to the tracking server
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <windows.h>
+#include <winhttp.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Connection statistics, accumulated since the dispatcher was created. The socket transport counts TCP connections
+// opened, reused by a request and closed for being idle. The WinHTTP transport counts its connect handles instead:
+// WinHTTP keeps the sockets underneath alive by itself and does not tell when they are reused.
+
+struct PiwikConnectionStatistics
+{
+	int Opens;
+	int Reuses;
+	int Evictions;
+
+	PiwikConnectionStatistics () : Opens(0), Reuses(0), Evictions(0) {}
+};
+
+// Loopback statistics, shared by a loopback transport and all its clones
+
+struct PiwikLoopbackStatistics
+{
+	int Exchanges;
+	int Failures;
+	int Requests;
+	_int64 Bytes;
+
+	PiwikLoopbackStatistics () : Exchanges(0), Failures(0), Requests(0), Bytes(0) {}
+};
+
+// Incremental reader of the response to a bulk request, fed with the content as it arrives so that it never has to be buffered.
+// Picks the number of tracked and invalid requests and the indices of the invalid ones out of the top-level object,
+// skipping anything else. Counts are -1 if the response did not report them.
+
+class PiwikBulkResponse
+{
+private:
+	int Depth;
+	bool Quoted, Escaped, Numeric, Value, Listing;
+	string Token;
+	string Key;
+
+	void EndToken ();
+
+public:
+	bool Success;
+	int Tracked;
+	int Invalid;
+	std::vector<int> Indices;
+	bool Complete;
+
+	PiwikBulkResponse ()   { Reset (); }
+
+	void Reset ();
+	void Feed (const char* data, size_t size);
+};
+
+// One HTTP exchange: what is to be sent, and what came back.
+// The host may carry an explicit port ("name:port"); for GET requests the path includes the query.
+// Count is the number of tracking requests the exchange carries, either one query or a bulk request.
+// RetryAfter is the delay in seconds the server asked for before the next request, if any.
+// Transports call Restart before every attempt and hand the content of the response to Receive as it arrives:
+// it is passed on to the parser, if any, and only kept as a whole if asked for.
+
+struct PiwikExchange
+{
+	wstring Host;
+	wstring Path;
+	PiwikMethod Method;
+	bool Secure;
+	LPCWSTR Headers;
+	const void* Data;
+	DWORD Size;
+	int Count;
+	PiwikBulkResponse* Parser;
+	bool Keep;
+	string Response;
+	DWORD RetryAfter;
+	DWORD Error;
+
+	PiwikExchange () : Method(PIWIK_METHOD_POST), Secure(false), Headers(L""), Data(0), Size(0), Count(0), Parser(0), Keep(false), RetryAfter(0), Error(0) {}
+
+	void Restart ()                                 { Response.clear (); RetryAfter = Error = 0; if (Parser) Parser->Reset (); }
+	void Receive (const char* data, size_t size)    { if (Parser) Parser->Feed (data, size); if (Keep) Response.append (data, size); }
+};
+
+// Carries exchanges to the server on behalf of one lane of the dispatcher.
+// The dispatcher clones the transport it has been given for every lane, so an instance is only ever used
+// by a single thread at a time and may keep connections and buffers without any locking.
+
+class PiwikTransport
+{
+public:
+	virtual ~PiwikTransport () {}
+
+	// Returns a new instance with the same settings, to be owned by the caller
+	virtual PiwikTransport* Clone () = 0;
+	// Returns the HTTP status code of the response, or zero if none could be obtained (with the error code in the exchange)
+	virtual int Send (PiwikExchange& ex) = 0;
+	// Closes connections that have been idle for longer than the idle timeout
+	virtual void Evict () {}
+	// Limits the time (msec) for establishing a connection and for every further phase of an exchange
+	virtual void SetTimeouts (int cnn, int rsp) {}
+	virtual void SetIdleTimeout (int t) {}
+	virtual int  CurrentIdleTimeout ()                              { return PIWIK_CONNECTION_IDLE_TIMEOUT; }
+	virtual PiwikConnectionStatistics CurrentStatistics ()          { return PiwikConnectionStatistics (); }
+};
+
+// WinHTTP connect handles to the tracking hosts, keyed by host name, port and secure flag, so that every request
+// does not have to create one. A connect handle is not a TCP connection: the session pools the sockets of all its
+// handles and keeps them alive for its own idle time, so closing a handle does not necessarily close a socket.
+// Used only from the thread owning the lane; handles unused for longer than the timeout are closed.
+
+class PiwikConnectHandlePool
+{
+private:
+	struct Entry
+	{
+		wstring Host;
+		INTERNET_PORT Port;
+		bool Secure;
+		HINTERNET Handle;
+		DWORD LastUsed;
+	};
+
+	std::vector<Entry> Items;
+	HINTERNET Session;
+	int IdleTimeout;
+	PiwikConnectionStatistics Statistics;
+
+public:
+	PiwikConnectHandlePool () : Session(0), IdleTimeout(PIWIK_CONNECTION_IDLE_TIMEOUT) {}
+	~PiwikConnectHandlePool ()                      { Clear (); }
+
+	void SetSession (HINTERNET s)                   { Session = s; }
+	HINTERNET CurrentSession ()                     { return Session; }
+	void SetIdleTimeout (int t)                     { IdleTimeout = t; }
+	int  CurrentIdleTimeout ()                      { return IdleTimeout; }
+	PiwikConnectionStatistics CurrentStatistics ()  { return Statistics; }
+
+	HINTERNET Acquire (wstring& host, bool sec);
+	void Discard (HINTERNET cnn);
+	void Evict ();
+	void Clear ();
+};
+
+// The WinHTTP transport, sending through a session opened by the dispatcher (whose timeouts apply unless set here).
+// Besides blocking exchanges it can start asynchronous ones, whose completion is then driven
+// by the status callback of the session; Finish has to be called once such an exchange is over.
+
+class PiwikWinHttpTransport : public PiwikTransport
+{
+private:
+	PiwikConnectHandlePool Handles;
+	HINTERNET Connection;
+	HINTERNET Handle;
+	int ConnectTimeout;
+	int ResponseTimeout;
+
+	HINTERNET Open (PiwikExchange& ex);
+	void ReadResponse (PiwikExchange& ex);
+
+public:
+	PiwikWinHttpTransport () : Connection(0), Handle(0), ConnectTimeout(0), ResponseTimeout(0) {}
+	~PiwikWinHttpTransport ()                                       { Finish (false); }
+
+	void SetSession (HINTERNET s)                                   { Handles.SetSession (s); }
+
+	PiwikTransport* Clone ();
+	int  Send (PiwikExchange& ex);
+	void Evict ()                                                   { Handles.Evict (); }
+	void SetTimeouts (int cnn, int rsp)                             { ConnectTimeout = cnn, ResponseTimeout = rsp; }
+	void SetIdleTimeout (int t)                                     { Handles.SetIdleTimeout (t); }
+	int  CurrentIdleTimeout ()                                      { return Handles.CurrentIdleTimeout (); }
+	PiwikConnectionStatistics CurrentStatistics ()                  { return Handles.CurrentStatistics (); }
+
+	bool Begin (PiwikExchange& ex, DWORD_PTR ctx);
+	void Finish (bool ok);
+	HINTERNET CurrentRequest ()                                     { return Handle; }
+};
+
+// Plain HTTP/1.1 over a socket of its own, kept alive between exchanges to the same host.
+// Uses nothing but the Berkeley socket calls, so it behaves the same wherever they are available;
+// secure connections are not supported.
+
+class PiwikSocketTransport : public PiwikTransport
+{
+private:
+	SOCKET Socket;
+	string Host;
+	string Port;
+	string Input;
+	DWORD LastUsed;
+	int ConnectTimeout;
+	int ResponseTimeout;
+	int IdleTimeout;
+	bool Started;
+	PiwikConnectionStatistics Statistics;
+
+	bool Connect ();
+	void Close ();
+	bool Write (const char* data, size_t size);
+	bool Fill ();
+	bool ReadLine (string& line);
+	bool ReadBody (size_t size, PiwikExchange& ex);
+	int  Receive (PiwikExchange& ex, bool& keep);
+
+public:
+	PiwikSocketTransport ();
+	~PiwikSocketTransport ();
+
+	PiwikTransport* Clone ();
+	int  Send (PiwikExchange& ex);
+	void Evict ();
+	void SetTimeouts (int cnn, int rsp)                             { ConnectTimeout = cnn, ResponseTimeout = rsp; }
+	void SetIdleTimeout (int t)                                     { IdleTimeout = t; }
+	int  CurrentIdleTimeout ()                                      { return IdleTimeout; }
+	PiwikConnectionStatistics CurrentStatistics ()                  { return Statistics; }
+};
+
+// In-process stand-in for the server: every exchange takes the given latency (msec) plus its size divided by
+// the bandwidth (bytes per second, zero for unlimited), and fails with the given rate (0 to 1). A failure returns
+// the given status code, or no response at all if it is zero. Bulk requests are answered like the server does.
+
+class PiwikLoopbackTransport : public PiwikTransport
+{
+private:
+	PiwikLoopbackTransport* Origin;
+	int Latency;
+	int Bandwidth;
+	double ErrorRate;
+	int ErrorCode;
+	unsigned int Seed;
+	volatile LONG Exchanges, Failures, Requests;
+	volatile LONGLONG Bytes;
+
+public:
+	PiwikLoopbackTransport (int lat = 0, int bnd = 0, double err = 0, int code = 503);
+
+	PiwikTransport* Clone ();
+	int  Send (PiwikExchange& ex);
+
+	PiwikLoopbackStatistics CurrentLoopbackStatistics ();
+};
@@ -97,6 +97,152 @@ bool PiwikVisitDimensionsSet::IsValid ()
 	
 	return false; 
 }
+// PiwikLock
+
+// Slow path of an acquisition: the lock is held by someone else, so block on it and account for the time spent
+
+void PiwikLock::Wait (bool shr)
+{
+	LARGE_INTEGER t0, t1;
+
+	::QueryPerformanceCounter (&t0);
+	if (shr)
+		::AcquireSRWLockShared (&Handle);
+	else
+		::AcquireSRWLockExclusive (&Handle);
+	::QueryPerformanceCounter (&t1);
+
+	::InterlockedIncrement64 (&Contentions);
+	::InterlockedExchangeAdd64 (&WaitTicks, t1.QuadPart - t0.QuadPart);
+}
+
+// Adds the counters of this lock to the given totals, so that several locks can be summed up
+
+void PiwikLock::CollectStatistics (PiwikLockStatistics& sts)
+{
+	LARGE_INTEGER frq;
+
+	::QueryPerformanceFrequency (&frq);
+	sts.Acquisitions += Acquisitions;
+	sts.Contentions += Contentions;
+	sts.WaitTime += (_int64) (WaitTicks * 1000000.0 / frq.QuadPart);
+}
+
+void PiwikLock::ResetStatistics ()
+{
+	::InterlockedExchange64 (&Acquisitions, 0);
+	::InterlockedExchange64 (&Contentions, 0);
+	::InterlockedExchange64 (&WaitTicks, 0);
+}
+
+// PiwikHistogram
+
+// Values below 2^Precision are their own bucket. Above, the exponent selects a group of 2^Precision buckets
+// and the bits following the leading one select the bucket within it.
+
+int PiwikHistogram::Bucket (_int64 v)
+{
+	int e = 0;
+
+	if (v < (1 << Precision))
+		return (int) max (v, (_int64) 0);
+
+	for (int s = 32; s > 0; s >>= 1)
+		if (v >> (e + s))
+			e += s;
+
+	return ((e - Precision + 1) << Precision) + (int) ((v >> (e - Precision)) & ((1 << Precision) - 1));
+}
+
+_int64 PiwikHistogram::Lowest (int idx)
+{
+	int e = (idx >> Precision) - 1 + Precision;
+
+	if (idx < (1 << Precision))
+		return idx;
+
+	return (_int64) ((1 << Precision) + (idx & ((1 << Precision) - 1))) << (e - Precision);
+}
+
+void PiwikHistogram::Record (_int64 v)
+{
+	LONGLONG cur;
+
+	v = max (v, (_int64) 0);
+	::InterlockedIncrement64 (&Counts[Bucket (v)]);
+	::InterlockedExchangeAdd64 (&Sum, v);
+
+	while (v < (cur = Min) && ::InterlockedCompareExchange64 (&Min, v, cur) != cur)
+		;
+	while (v > (cur = Max) && ::InterlockedCompareExchange64 (&Max, v, cur) != cur)
+		;
+}
+
+// Copies the buckets into the snapshot, emptying them at the same time if asked to.
+// The count is that of the values found in the buckets, so that percentiles always add up.
+
+void PiwikHistogram::Collect (PiwikHistogramSnapshot& snp, bool rst)
+{
+	snp.Buckets.resize (BucketCount);
+	snp.Count = 0;
+
+	for (int i = 0; i < BucketCount; i++)
+	{
+		snp.Buckets[i] = (rst ? ::InterlockedExchange64 (&Counts[i], 0) : ::InterlockedCompareExchange64 (&Counts[i], 0, 0));
+		snp.Count += snp.Buckets[i];
+	}
+
+	if (rst)
+	{
+		snp.Sum = ::InterlockedExchange64 (&Sum, 0);
+		snp.Min = ::InterlockedExchange64 (&Min, _I64_MAX);
+		snp.Max = ::InterlockedExchange64 (&Max, 0);
+	}
+	else
+	{
+		snp.Sum = ::InterlockedCompareExchange64 (&Sum, 0, 0);
+		snp.Min = ::InterlockedCompareExchange64 (&Min, 0, 0);
+		snp.Max = ::InterlockedCompareExchange64 (&Max, 0, 0);
+	}
+
+	if (snp.Count == 0)
+		snp.Sum = snp.Min = snp.Max = 0;
+}
+
+// PiwikHistogramSnapshot
+
+// Value below which the given percentage (0 to 100) of the recorded values lies: the upper end of the bucket
+// holding the value of that rank, kept within the extremes actually recorded
+
+_int64 PiwikHistogramSnapshot::Percentile (double p)
+{
+	_int64 rnk, n = 0;
+	int i;
+
+	if (Count == 0 || Buckets.empty ())
+		return 0;
+
+	rnk = max ((_int64) 1, (_int64) ceil (min (max (p, 0.0), 100.0) * Count / 100));
+
+	for (i = 0; i < (int) Buckets.size () - 1; i++)
+		if ((n += Buckets[i]) >= rnk)
+			break;
+
+	return max (Min, min (Max, PiwikHistogram::Highest (i)));
+}
+
+// PiwikCounters
+
+_int64 PiwikCounters::Sum (PiwikCounter c)
+{
+	_int64 n = 0;
+
+	for (int i = 0; i < Shards; i++)
+		n += ::InterlockedCompareExchange64 (&Items[i].Values[c], 0, 0);
+
+	return n;
+}
+
 // PiwikLogger
 
 void PiwikLogger::Log (LPCWSTR msg, LPCSTR data, int code, int lvl)
@@ -333,6 +479,9 @@ bool ComposeUrl (TSTRING& prf, TSTRING& url)
 	return ! url.empty ();
 }
 
+// Values are kept under HKEY_CURRENT_USER\Software\<apl>\<usr>\Piwik, or under Software\<apl>\Piwik if usr is empty.
+// The key is created when a value is first written.
+
 _int64 ReadRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name)
 {
 	TSTRING key;
@@ -341,7 +490,10 @@ _int64 ReadRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name)
 	DWORD dwType, dwSize = sizeof(val);
 	LONG rsl;
 
-	key = _T("Software\\"); key += apl; key += _T("\\"); key += usr; key += _T("\\"); key += _T("\\Piwik");
+	key = _T("Software\\"); key += apl;
+	if (*usr)
+		key += _T("\\"), key += usr;
+	key += _T("\\Piwik");
 	rsl = ::RegOpenKeyEx (HKEY_CURRENT_USER, key.c_str (), 0, KEY_READ, &hKey);
 	if (rsl == ERROR_SUCCESS)
 	{
@@ -358,8 +510,11 @@ bool WriteRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name, _int64 val)
 	HKEY hKey;
 	LONG rsl;
 
-	key = _T("Software\\"); key += apl; key += _T("\\"); key += usr; key += _T("\\"); key += _T("\\Piwik");
-	rsl = ::RegOpenKeyEx (HKEY_CURRENT_USER, key.c_str (), 0, KEY_SET_VALUE, &hKey);
+	key = _T("Software\\"); key += apl;
+	if (*usr)
+		key += _T("\\"), key += usr;
+	key += _T("\\Piwik");
+	rsl = ::RegCreateKeyEx (HKEY_CURRENT_USER, key.c_str (), 0, 0, REG_OPTION_NON_VOLATILE, KEY_SET_VALUE, 0, &hKey, 0);
 	if (rsl == ERROR_SUCCESS)
 	{
 		rsl = ::RegSetValueEx (hKey, name, 0, REG_QWORD, (LPBYTE) &val, sizeof (val));
@@ -368,3 +523,104 @@ bool WriteRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name, _int64 val)
 
 	return (rsl == ERROR_SUCCESS);
 }
+
+// Standard CRC-32 (as used by gzip and zip), continuing from the CRC of preceding data if given.
+// The table is built on first use; threads racing on it would only write the same values.
+
+DWORD ComputeCrc32 (const void* data, size_t n, DWORD crc)
+{
+	static DWORD table[256];
+	static volatile LONG ready = 0;
+	const BYTE* p = (const BYTE*) data;
+	DWORD c;
+
+	if (! ready)
+	{
+		for (DWORD i = 0; i < 256; i++)
+		{
+			c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+			table[i] = c;
+		}
+		::InterlockedExchange (&ready, 1);
+	}
+
+	for (c = crc ^ 0xFFFFFFFF; n-- > 0; p++)
+		c = table[(c ^ *p) & 0xFF] ^ (c >> 8);
+
+	return c ^ 0xFFFFFFFF;
+}
+
+// FNV-1a hash, cheap and well spread over short keys like visitor ids
+
+DWORD ComputeHash (const void* data, size_t n)
+{
+	const BYTE* p = (const BYTE*) data;
+	DWORD h = 2166136261;
+
+	while (n-- > 0)
+		h = (h ^ *p++) * 16777619;
+
+	return h;
+}
+
+// Finalizer from MurmurHash3, spreading every bit of a hash value over all others, 
+// so that hashes of similar keys land far apart
+
+DWORD MixHash (DWORD h)
+{
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+// Random number from the system's cryptographic provider, to identify an installation. Should the provider
+// not be available, falls back on the clock, the process and the address space, which still differ between machines.
+
+ULONGLONG MakeRandomValue ()
+{
+	HCRYPTPROV hProv = 0;
+	ULONGLONG val = 0;
+
+	if (::CryptAcquireContext (&hProv, 0, 0, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+	{
+		if (! ::CryptGenRandom (hProv, sizeof val, (BYTE*) &val))
+			val = 0;
+		::CryptReleaseContext (hProv, 0);
+	}
+
+	if (val == 0)
+		val = ((ULONGLONG) ::GetCurrentProcessId () << 32 ^ (ULONGLONG) ReadClock () ^ (ULONGLONG) (DWORD_PTR) &hProv) * 0x9E3779B97F4A7C15ULL;
+
+	return val;
+}
+
+// Reading of the high-resolution performance counter, and the time between two readings
+
+LONGLONG ReadClock ()
+{
+	LARGE_INTEGER t;
+
+	::QueryPerformanceCounter (&t);
+
+	return t.QuadPart;
+}
+
+_int64 ElapsedMicroseconds (LONGLONG t0, LONGLONG t1)
+{
+	static LONGLONG frq = 0;
+	LARGE_INTEGER f;
+
+	if (frq == 0)
+	{
+		::QueryPerformanceFrequency (&f);
+		frq = f.QuadPart;
+	}
+
+	return (_int64) ((t1 - t0) * 1000000.0 / frq);
+}
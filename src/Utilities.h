@@ -16,8 +16,12 @@
 #include <windows.h>
 #include <tchar.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <math.h>
+#include <string.h>
 #include <time.h>
 #include <string>
+#include <vector>
 #include <sstream>
 #include <ostream>
 
@@ -57,6 +61,85 @@ enum PiwikQueryFormat
 	PIWIK_FORMAT_JSON
 };
 
+enum PiwikCompression
+{
+	PIWIK_COMPRESSION_NONE,
+	PIWIK_COMPRESSION_GZIP,
+	PIWIK_COMPRESSION_DEFLATE
+};
+
+enum PiwikOverflowPolicy
+{
+	PIWIK_OVERFLOW_DROP_OLDEST,
+	PIWIK_OVERFLOW_DROP_NEWEST,
+	PIWIK_OVERFLOW_DROP_PRIORITY,
+	PIWIK_OVERFLOW_BLOCK
+};
+
+enum PiwikPriority
+{
+	PIWIK_PRIORITY_AUTO = -1,
+	PIWIK_PRIORITY_LOW,
+	PIWIK_PRIORITY_NORMAL,
+	PIWIK_PRIORITY_ELEVATED,
+	PIWIK_PRIORITY_HIGH,
+	PIWIK_PRIORITY_LEVELS
+};
+
+enum PiwikTrackingKind
+{
+	PIWIK_TRACK_EVENT,
+	PIWIK_TRACK_SCREEN,
+	PIWIK_TRACK_ACTION,
+	PIWIK_TRACK_GOAL,
+	PIWIK_TRACK_OUTLINK,
+	PIWIK_TRACK_IMPRESSION,
+	PIWIK_TRACK_INTERACTION,
+	PIWIK_TRACK_CUSTOM,
+	PIWIK_TRACK_KINDS
+};
+
+enum PiwikAggregationKey
+{
+	PIWIK_AGGREGATE_CATEGORY = 1,
+	PIWIK_AGGREGATE_ACTION   = 2,
+	PIWIK_AGGREGATE_NAME     = 4,
+	PIWIK_AGGREGATE_PATH     = 8,
+	PIWIK_AGGREGATE_DEFAULT  = 7
+};
+
+enum PiwikBreakerState
+{
+	PIWIK_BREAKER_CLOSED,
+	PIWIK_BREAKER_OPEN,
+	PIWIK_BREAKER_HALF_OPEN
+};
+
+enum PiwikRequestStatus
+{
+	PIWIK_STATUS_UNKNOWN  = -4,
+	PIWIK_STATUS_DROPPED  = -3,
+	PIWIK_STATUS_REJECTED = -2,
+	PIWIK_STATUS_FAILED   = -1,
+	PIWIK_STATUS_PENDING  = 0,
+	PIWIK_STATUS_SENT     = 1,
+	PIWIK_STATUS_PERSISTED = 2
+};
+
+enum PiwikCounter
+{
+	PIWIK_COUNT_TRACKED,
+	PIWIK_COUNT_DISABLED,
+	PIWIK_COUNT_QUEUED,
+	PIWIK_COUNT_RETRIED,
+	PIWIK_COUNT_BUNDLES,
+	PIWIK_COUNT_WIRE_BYTES,
+	PIWIK_COUNT_TRACK_TIME,
+	PIWIK_COUNT_SERIALIZE_TIME,
+	PIWIK_COUNT_SEND_TIME,
+	PIWIK_COUNTERS
+};
+
 enum PiwikLogLevel
 {
 	PIWIK_LOG_DEBUG,
@@ -103,17 +186,43 @@ struct PiwikVisitDimensionsSet
 
 
 
+// Lock statistics, accumulated since creation or the last reset (times in microseconds)
+
+struct PiwikLockStatistics
+{
+	_int64 Acquisitions;
+	_int64 Contentions;
+	_int64 WaitTime;
+
+	PiwikLockStatistics () : Acquisitions(0), Contentions(0), WaitTime(0) {}
+};
+
+// User-mode lock based on a slim reader/writer lock: uncontended acquisitions never enter the kernel.
+// Exclusive and shared ownership are available; the lock is not recursive.
+// While held exclusively, it can be given up for waiting on a condition variable (Await).
+// Every acquisition is counted, and those that had to wait are timed.
+
 class PiwikLock
 {
 private:
-	HANDLE Handle;
+	SRWLOCK Handle;
+	volatile LONGLONG Acquisitions;
+	volatile LONGLONG Contentions;
+	volatile LONGLONG WaitTicks;
+
+	void Wait (bool shr);
 
 public:
-	PiwikLock ()       { Handle = ::CreateMutex (0, false, 0); }
-	~PiwikLock ()      { if (Handle) ::CloseHandle (Handle); }
+	PiwikLock ()             { ::InitializeSRWLock (&Handle); Acquisitions = Contentions = WaitTicks = 0; }
 	
-	bool Activate ()   { return (Handle && ::WaitForSingleObject (Handle, INFINITE) == WAIT_OBJECT_0); }
-	void Release ()    { if (Handle) ::ReleaseMutex (Handle); }
+	bool Activate ()         { ::InterlockedIncrement64 (&Acquisitions); if (! ::TryAcquireSRWLockExclusive (&Handle)) Wait (false); return true; }
+	void Release ()          { ::ReleaseSRWLockExclusive (&Handle); }
+	bool ActivateShared ()   { ::InterlockedIncrement64 (&Acquisitions); if (! ::TryAcquireSRWLockShared (&Handle)) Wait (true); return true; }
+	void ReleaseShared ()    { ::ReleaseSRWLockShared (&Handle); }
+	bool Await (CONDITION_VARIABLE& cnd, DWORD tmo)   { return (::SleepConditionVariableSRW (&cnd, &Handle, tmo, 0) != 0); }
+
+	void CollectStatistics (PiwikLockStatistics& sts);
+	void ResetStatistics ();
 };
 
 class PiwikScopedLock
@@ -126,6 +235,87 @@ public:
 	~PiwikScopedLock ()                 { if (Lock) Lock->Release (); }
 };
 
+class PiwikSharedLock
+{
+private:
+	PiwikLock* Lock;
+	
+public:
+	PiwikSharedLock (PiwikLock& lck)    { Lock = (lck.ActivateShared () ? &lck : 0); }
+	~PiwikSharedLock ()                 { if (Lock) Lock->ReleaseShared (); }
+};
+
+// Distribution of values recorded by a histogram, since its creation or the last reset.
+// Buckets hold the number of values falling into each range (see PiwikHistogram); Min and Max are exact.
+
+struct PiwikHistogramSnapshot
+{
+	_int64 Count;
+	_int64 Sum;
+	_int64 Min;
+	_int64 Max;
+	std::vector<_int64> Buckets;
+
+	PiwikHistogramSnapshot () : Count(0), Sum(0), Min(0), Max(0) {}
+
+	double Mean ()                  { return (Count ? (double) Sum / Count : 0); }
+	_int64 Percentile (double p);
+};
+
+// Histogram of non-negative values in fixed buckets, HDR-style: values below 8 have a bucket each, and every further
+// power of two is split into 8 buckets, so a value is known to within an eighth whatever its magnitude.
+// Recording takes a few interlocked operations and no lock, so any thread may record at any time. A snapshot taken
+// meanwhile may miss the values being recorded, and one that resets the histogram hands each of them to either side.
+
+class PiwikHistogram
+{
+public:
+	static const int Precision = 3;
+	static const int BucketCount = (64 - Precision) << Precision;
+
+	static int    Bucket (_int64 v);
+	static _int64 Lowest (int idx);
+	static _int64 Highest (int idx)     { return (idx + 1 < BucketCount ? Lowest (idx + 1) - 1 : _I64_MAX); }
+
+private:
+	volatile LONGLONG Counts[BucketCount];
+	volatile LONGLONG Sum;
+	volatile LONGLONG Min;
+	volatile LONGLONG Max;
+
+public:
+	PiwikHistogram ()                   { Reset (); }
+
+	void Record (_int64 v);
+	void Collect (PiwikHistogramSnapshot& snp, bool rst = false);
+	void Reset ()                       { PiwikHistogramSnapshot snp; Collect (snp, true); }
+};
+
+// Counters split into shards, so that threads counting at the same time hardly ever touch the same memory:
+// each thread adds to the shard its id is hashed to, and reading a counter sums it up over all shards.
+// Shards are padded so that no two of them share a cache line.
+
+class PiwikCounters
+{
+public:
+	static const int Shards = 16;
+
+private:
+	struct Shard
+	{
+		volatile LONGLONG Values[PIWIK_COUNTERS];
+		LONGLONG Padding[8];
+	};
+
+	Shard Items[Shards];
+
+public:
+	PiwikCounters ()                            { memset ((void*) Items, 0, sizeof (Items)); }
+
+	void   Add (PiwikCounter c, _int64 v)      { ::InterlockedExchangeAdd64 (&Items[((::GetCurrentThreadId () * 2654435769u) >> 16) % Shards].Values[c], v); }
+	_int64 Sum (PiwikCounter c);
+};
+
 class PiwikLogger
 {
 private:
@@ -137,6 +327,8 @@ public:
 	PiwikLogger ()                          { Stream = 0; Level = PIWIK_INITIAL_LOG_LEVEL; }
 	void SetStream (wostream* s)            { Stream = s; }
 	void SetLevel (PiwikLogLevel lvl)       { Level = lvl; }
+	void CollectLockStatistics (PiwikLockStatistics& sts)   { Mutex.CollectStatistics (sts); }
+	void ResetLockStatistics ()                             { Mutex.ResetStatistics (); }
 
 	void Log (LPCWSTR msg, LPCSTR data = 0, int code = 0, int lvl = -1);
 
@@ -156,4 +348,10 @@ TSTRING  GetScreenResolution ();
 bool     ComposeUrl (TSTRING& prf, TSTRING& url);
 _int64   ReadRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name);
 bool     WriteRegistryValue (LPCTSTR apl, LPCTSTR usr, LPCTSTR name, _int64 val);
+DWORD    ComputeCrc32 (const void* data, size_t n, DWORD crc = 0);
+DWORD    ComputeHash (const void* data, size_t n);
+DWORD    MixHash (DWORD h);
+ULONGLONG MakeRandomValue ();
+LONGLONG ReadClock ();
+_int64   ElapsedMicroseconds (LONGLONG t0, LONGLONG t1);
 
@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File:         JournalTest.cpp
+// Description:  Checks of the request journal: records completed out of order and replayed after a restart
+// Project:      Piwik-SDK-Win-C++
+// Version:      1.0
+// Date:         2016-09-19
+// Author:       Manfred Klimt - Diogen Software-Entwicklung (bramfeld@diogen.de)
+// Copyright:    (c) 2016 mplabsorg
+// License:      See provided LICENSE file
+//
+// Build from a Visual Studio command prompt in this folder, then run; the exit code is the number of failures:
+//   cl /EHsc /DUNICODE /D_UNICODE /I..\src JournalTest.cpp ..\src\Journal.cpp ..\src\Utilities.cpp advapi32.lib user32.lib
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Config.h"
+#include "Utilities.h"
+#include "Journal.h"
+#include <stdio.h>
+
+#define JOURNAL_PATH  _T("JournalTest.dat")
+
+static int Failures = 0;
+
+static void Check (bool cnd, const char* msg)
+{
+	if (! cnd)
+	{
+		printf ("FAILED: %s\n", msg);
+		Failures++;
+	}
+}
+
+static LONGLONG Append (PiwikJournal& jrn, const char* qry)
+{
+	PiwikJournalEntry ent;
+
+	ent.Method = PIWIK_METHOD_POST;
+	ent.Host = L"piwik.example.org";
+	ent.Path = L"/piwik.php";
+	ent.Query = qry;
+
+	return jrn.Append (ent);
+}
+
+// Reopens the journal and compares the requests it replays with the expected queries, in order
+
+static void Replay (PiwikJournal& jrn, const char** exp, int cnt, const char* msg)
+{
+	std::vector<PiwikJournalEntry> pnd;
+
+	jrn.Close ();
+	Check (jrn.Open (JOURNAL_PATH, 65536, pnd), msg);
+	Check ((int) pnd.size () == cnt, msg);
+	for (int i = 0; i < cnt && i < (int) pnd.size (); i++)
+	{
+		Check (pnd[i].Query == exp[i], msg);
+		Check (pnd[i].Host == L"piwik.example.org" && pnd[i].Path == L"/piwik.php", msg);
+	}
+}
+
+// Records completed in the middle of the journal must neither stop the replay nor be replayed themselves
+
+static void TestCompletedInTheMiddle ()
+{
+	PiwikJournal jrn;
+	std::vector<PiwikJournalEntry> pnd;
+	LONGLONG ids[5];
+	const char* qry[] = { "idsite=1&rec=1&e_c=one", "idsite=1&rec=1&e_c=two", "idsite=1&rec=1&e_c=three", "idsite=1&rec=1&e_c=four", "idsite=1&rec=1&e_c=five" };
+	const char* rst[] = { "idsite=1&rec=1&e_c=one", "idsite=1&rec=1&e_c=three", "idsite=1&rec=1&e_c=five" };
+	const char* add[] = { "idsite=1&rec=1&e_c=one", "idsite=1&rec=1&e_c=three", "idsite=1&rec=1&e_c=five", "idsite=1&rec=1&e_c=six" };
+
+	::DeleteFile (JOURNAL_PATH);
+	Check (jrn.Open (JOURNAL_PATH, 65536, pnd) && pnd.empty (), "new journal opens empty");
+
+	for (int i = 0; i < 5; i++)
+		Check ((ids[i] = Append (jrn, qry[i])) != 0, "records are appended");
+
+	jrn.Complete (ids[3]);
+	jrn.Complete (ids[1]);
+	Replay (jrn, rst, 3, "pending records around completed ones are replayed");
+
+	// the tail must follow the last replayed record, so that new records do not overwrite pending ones
+	Check (Append (jrn, "idsite=1&rec=1&e_c=six") != 0, "record is appended after replay");
+	Replay (jrn, add, 4, "records appended after a replay keep the pending ones");
+
+	jrn.Close ();
+	::DeleteFile (JOURNAL_PATH);
+}
+
+// Completing the leading records moves the head, and a journal completed entirely replays nothing
+
+static void TestCompletedAll ()
+{
+	PiwikJournal jrn;
+	std::vector<PiwikJournalEntry> pnd;
+	LONGLONG ids[3];
+	const char* rst[] = { "idsite=1&rec=1&e_c=c" };
+
+	::DeleteFile (JOURNAL_PATH);
+	Check (jrn.Open (JOURNAL_PATH, 65536, pnd), "new journal opens");
+
+	ids[0] = Append (jrn, "idsite=1&rec=1&e_c=a");
+	ids[1] = Append (jrn, "idsite=1&rec=1&e_c=b");
+	ids[2] = Append (jrn, "idsite=1&rec=1&e_c=c");
+	jrn.Complete (ids[1]);
+	jrn.Complete (ids[0]);
+	Replay (jrn, rst, 1, "records completed at the head are not replayed");
+
+	jrn.Complete (ids[2]);
+	Replay (jrn, rst, 0, "completed journal replays nothing");
+
+	jrn.Close ();
+	::DeleteFile (JOURNAL_PATH);
+}
+
+int main ()
+{
+	TestCompletedInTheMiddle ();
+	TestCompletedAll ();
+
+	printf ("%s: %d failure(s)\n", (Failures ? "FAILED" : "PASSED"), Failures);
+
+	return Failures;
+}